@@ -0,0 +1,54 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+ * Debug build only, see LIVEUPDATE_DEBUG_ALLOC in CMakeLists.txt.
+ * The service is linked with --wrap for each allocator function,
+ * so that allocations between cli and the swap in begin() are counted.
+ *
+**/
+#include <cstddef>
+#include <cstdint>
+
+extern bool     LIVEUPDATE_CRITICAL_SECTION;
+extern uint32_t LIVEUPDATE_CRITICAL_ALLOCS;
+
+extern "C" {
+void* __real_malloc(size_t);
+void* __real_calloc(size_t, size_t);
+void* __real_realloc(void*, size_t);
+void* __real_memalign(size_t, size_t);
+int   __real_posix_memalign(void**, size_t, size_t);
+void* __real_aligned_alloc(size_t, size_t);
+
+void* __wrap_malloc(size_t size)
+{
+  if (LIVEUPDATE_CRITICAL_SECTION) LIVEUPDATE_CRITICAL_ALLOCS++;
+  return __real_malloc(size);
+}
+void* __wrap_calloc(size_t count, size_t size)
+{
+  if (LIVEUPDATE_CRITICAL_SECTION) LIVEUPDATE_CRITICAL_ALLOCS++;
+  return __real_calloc(count, size);
+}
+void* __wrap_realloc(void* ptr, size_t size)
+{
+  if (LIVEUPDATE_CRITICAL_SECTION) LIVEUPDATE_CRITICAL_ALLOCS++;
+  return __real_realloc(ptr, size);
+}
+void* __wrap_memalign(size_t align, size_t size)
+{
+  if (LIVEUPDATE_CRITICAL_SECTION) LIVEUPDATE_CRITICAL_ALLOCS++;
+  return __real_memalign(align, size);
+}
+int __wrap_posix_memalign(void** ptr, size_t align, size_t size)
+{
+  if (LIVEUPDATE_CRITICAL_SECTION) LIVEUPDATE_CRITICAL_ALLOCS++;
+  return __real_posix_memalign(ptr, align, size);
+}
+void* __wrap_aligned_alloc(size_t align, size_t size)
+{
+  if (LIVEUPDATE_CRITICAL_SECTION) LIVEUPDATE_CRITICAL_ALLOCS++;
+  return __real_aligned_alloc(align, size);
+}
+}
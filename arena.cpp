@@ -0,0 +1,130 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#include "arena.hpp"
+#include "liveupdate.hpp"
+#include "storage.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+// incremented by every store() and begin()
+extern uint32_t LIVEUPDATE_STORE_GENERATION;
+
+namespace liu
+{
+Arena::Arena(void* b, size_t len, bool compare)
+  : base((char*) b), length(len), compare_on_store(compare)
+{
+  bitmap.resize((pages() + 63) / 64);
+  invalidate();
+}
+
+size_t Arena::page_length(size_t page) const noexcept
+{
+  const size_t offset = page * PAGE_SIZE;
+  return (length - offset < PAGE_SIZE) ? length - offset : PAGE_SIZE;
+}
+bool Arena::has_image() const noexcept
+{
+  // the storage area is overwritten by every store
+  return image != nullptr && image_generation == LIVEUPDATE_STORE_GENERATION;
+}
+
+void Arena::mark_dirty(const void* ptr, size_t len) noexcept
+{
+  const char* begin = (const char*) ptr;
+  if (len == 0 || begin < base || begin >= base + length) return;
+  const size_t offset = begin - base;
+  const size_t end    = std::min(offset + len, length);
+  const size_t first  = offset / PAGE_SIZE;
+  const size_t last   = (end - 1) / PAGE_SIZE;
+  for (size_t page = first; page <= last; page++) set_dirty(page);
+}
+
+size_t Arena::scan() noexcept
+{
+  // without a previous image the next snapshot copies everything anyway
+  if (has_image() == false) return 0;
+  return compare(image);
+}
+size_t Arena::compare(const char* previous) noexcept
+{
+  size_t found = 0;
+  for (size_t page = 0; page < pages(); page++)
+  {
+    const size_t offset = page * PAGE_SIZE;
+    if (is_dirty(page) == false
+     && memcmp(&base[offset], &previous[offset], page_length(page)) != 0) {
+      set_dirty(page);
+      found++;
+    }
+  }
+  return found;
+}
+
+size_t Arena::dirty_pages() const noexcept
+{
+  size_t count = 0;
+  for (auto word : bitmap) count += __builtin_popcountll(word);
+  return count;
+}
+
+size_t Arena::snapshot(char* dest, bool full) noexcept
+{
+  // @dest still holds the previous snapshot
+  if (full == false && compare_on_store) compare(dest);
+
+  size_t copied = 0;
+  for (size_t page = 0; page < pages(); page++)
+  {
+    if (full || is_dirty(page))
+    {
+      const size_t offset = page * PAGE_SIZE;
+      memcpy(&dest[offset], &base[offset], page_length(page));
+      copied++;
+    }
+  }
+  std::fill(bitmap.begin(), bitmap.end(), 0);
+  return copied;
+}
+
+void Arena::invalidate() noexcept
+{
+  // the next snapshot has to copy everything
+  this->image = nullptr;
+  std::fill(bitmap.begin(), bitmap.end(), 0);
+}
+
+void Storage::add_arena(uid id, Arena& arena)
+{
+  auto& entry = hdr.add_struct(TYPE_ARENA, id, sizeof(arena_entry) + arena.size());
+  auto* aent = (arena_entry*) entry.vla;
+  aent->length = arena.size();
+  // the previous image can only be reused if it was stored at the very
+  // same place, by the store right before this one
+  const bool full = arena.image != aent->vla
+      || arena.image_generation + 1 != LIVEUPDATE_STORE_GENERATION;
+
+  arena.snapshot(aent->vla, full);
+  arena.image = aent->vla;
+  arena.image_generation = LIVEUPDATE_STORE_GENERATION;
+}
+
+void Restore::as_arena(Arena& arena) const
+{
+  if (ent->type != TYPE_ARENA)
+      throw std::runtime_error("Incorrect type: " + std::to_string(ent->type));
+
+  auto* aent = (const arena_entry*) ent->vla;
+  if (aent->length != arena.size())
+      throw std::runtime_error("Mismatching arena size for id " + std::to_string(get_id()));
+
+  memcpy(arena.data(), aent->vla, aent->length);
+  // the storage area is zeroed after resume
+  arena.invalidate();
+}
+
+} // liu
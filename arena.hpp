@@ -0,0 +1,80 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#pragma once
+#ifndef LIVEUPDATE_ARENA_HPP
+#define LIVEUPDATE_ARENA_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace liu
+{
+/**
+ * An Arena is a memory region holding large, mostly static state, such as
+ * lookup tables. It is stored with Storage::add_arena(), and only the pages
+ * modified since the previous snapshot are copied, as long as the previous
+ * snapshot was stored at the same place by the store() or begin() right
+ * before. Periodic calls to LiveUpdate::store() therefore keep the cost of
+ * begin() proportional to the write rate, not the size of the arena.
+ *
+ * Modified pages are not tracked by the hardware: that needs the arena
+ * write-protected after each snapshot, and a page fault handler that marks
+ * and unprotects the page, which this library has no access to. Instead the
+ * writer reports modified ranges with mark_dirty(), which keeps the cost of
+ * a snapshot proportional to the pages written. Arenas whose writers cannot
+ * do that may set compare_on_store, which compares every page with the
+ * previous snapshot when the arena is stored. That finds every change, but
+ * reads the whole arena, so it is no cheaper than copying it.
+ *
+**/
+struct Arena
+{
+  static const size_t PAGE_SIZE = 4096;
+
+  Arena(void* base, size_t length, bool compare_on_store = false);
+
+  char*  data() const noexcept { return base; }
+  size_t size() const noexcept { return length; }
+  size_t pages() const noexcept { return (length + PAGE_SIZE - 1) / PAGE_SIZE; }
+
+  // mark a range as modified since the last snapshot
+  void   mark_dirty(const void*, size_t) noexcept;
+  // compare every page with the last snapshot, if it is still intact, and
+  // mark the ones that differ. Returns the number of pages that were found
+  size_t scan() noexcept;
+  // number of pages that will be copied by the next snapshot
+  size_t dirty_pages() const noexcept;
+
+private:
+  bool is_dirty(size_t page) const noexcept {
+    return bitmap[page / 64] & (1ull << (page % 64));
+  }
+  void set_dirty(size_t page) noexcept {
+    bitmap[page / 64] |= 1ull << (page % 64);
+  }
+  size_t page_length(size_t page) const noexcept;
+  bool   has_image() const noexcept;
+  size_t compare(const char* previous) noexcept;
+  // copy dirty pages into @image, or everything when @full is set
+  size_t snapshot(char* image, bool full) noexcept;
+  void   invalidate() noexcept;
+
+  char*  base;
+  size_t length;
+  bool   compare_on_store;
+  std::vector<uint64_t> bitmap;
+  // where the last snapshot was stored, and by which store
+  const char* image = nullptr;
+  uint32_t    image_generation = 0;
+
+  friend struct Storage;
+  friend struct Restore;
+};
+
+} // liu
+
+#endif
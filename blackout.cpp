@@ -0,0 +1,212 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#include "blackout.hpp"
+#include "liveupdate.hpp"
+#include "storage.hpp"
+#include <kernel/os.hpp>
+#include <timers>
+#include <algorithm>
+#include <cstring>
+
+//#define LPRINT(x, ...) printf(x, ##__VA_ARGS__);
+#define LPRINT(x, ...) /** x **/
+// set while begin() runs with interrupts disabled, see update.cpp
+extern bool LIVEUPDATE_CRITICAL_SECTION;
+
+namespace liu
+{
+static const char* BLACKOUT_SECTION = "liu/blackout";
+// how often restored connections are polled, which is the resolution of
+// the measurement, and for how long after boot
+static const std::chrono::milliseconds POLL_INTERVAL {1};
+static const int64_t POLL_DURATION = 30 * 1000000ll;
+// records reserved before an update, see blackout_reserve()
+static const size_t MIN_RESERVE = 1024;
+
+// connections serialized during the current store, with their timestamp
+static std::vector<std::pair<blackout_record, int64_t>> frozen;
+// connections that did not fit in the reserved records
+static uint32_t dropped = 0;
+
+struct restored_conn
+{
+  std::weak_ptr<net::tcp::Connection> conn;
+  net::tcp::seq_t snd_nxt;
+  net::tcp::seq_t rcv_nxt;
+  blackout_record* record;
+};
+static std::vector<restored_conn>   restored;
+static std::vector<blackout_record> records;
+static uint32_t records_dropped = 0;
+static int poll_timer = -1;
+
+void blackout_reserve()
+{
+  // room for the connections from the last update, and then some
+  frozen.reserve(std::max(MIN_RESERVE, 2 * records.size()));
+  dropped = 0;
+}
+void blackout_frozen(const net::tcp::Connection& conn, int state_len)
+{
+  // the records cannot grow with interrupts disabled
+  if (LIVEUPDATE_CRITICAL_SECTION && frozen.size() == frozen.capacity()) {
+    dropped++;
+    return;
+  }
+  blackout_record rec;
+  rec.local     = conn.local();
+  rec.remote    = conn.remote();
+  rec.sendq     = conn.sendq_size();
+  rec.readq     = conn.readq_size();
+  rec.state_len = state_len;
+  rec.reserved  = 0;
+  rec.first_sent     = -1;
+  rec.first_received = -1;
+  frozen.emplace_back(rec, OS::micros_since_boot());
+}
+
+void blackout_store(storage_header& hdr)
+{
+  if (frozen.empty() && dropped == 0) return;
+  if (hdr.is_legacy() == false)
+  {
+    const int64_t now = OS::micros_since_boot();
+    hdr.add_section(BLACKOUT_SECTION, strlen(BLACKOUT_SECTION));
+    // a vector of records, written in place
+    hdr.var_entry(TYPE_VECTOR, 0,
+    [now] (char* location) -> int
+    {
+      auto& segs = *(segmented_entry*) location;
+      segs.count = frozen.size();
+      segs.esize = sizeof(blackout_record);
+      auto* out = (blackout_record*) segs.vla;
+      for (auto& f : frozen) {
+        *out = f.first;
+        out->frozen = now - f.second;
+        out++;
+      }
+      return sizeof(segmented_entry) + segs.count * segs.esize;
+    });
+    hdr.add_int(1, dropped);
+  }
+  frozen.clear();
+  dropped = 0;
+}
+
+// true when @rc needs no more polling
+static bool poll_one(restored_conn& rc, int64_t now)
+{
+  if (rc.record == nullptr) return true;
+  auto conn = rc.conn.lock();
+  // closed connections are left pending
+  if (conn == nullptr) return true;
+  auto& rec = *rc.record;
+  const auto& tcb = conn->tcb();
+  if (rec.first_sent < 0 && tcb.SND.NXT != rc.snd_nxt)
+      rec.first_sent = rec.frozen + now;
+  if (rec.first_received < 0 && tcb.RCV.NXT != rc.rcv_nxt)
+      rec.first_received = rec.frozen + now;
+  return rec.first_sent >= 0 && rec.first_received >= 0;
+}
+static void schedule_poll();
+
+static void poll_restored()
+{
+  poll_timer = -1;
+  const int64_t now = OS::micros_since_boot();
+  // connections that are accounted for are not polled again
+  restored.erase(std::remove_if(restored.begin(), restored.end(),
+    [now] (restored_conn& rc) { return poll_one(rc, now); }),
+    restored.end());
+
+  if (restored.empty() || now > POLL_DURATION) {
+    LPRINT("* Blackout accounting done, %zu connections pending\n", restored.size());
+    restored.clear();
+    restored.shrink_to_fit();
+    return;
+  }
+  schedule_poll();
+}
+static void schedule_poll()
+{
+  poll_timer = Timers::oneshot(POLL_INTERVAL, [] (int) { poll_restored(); });
+}
+
+// the records are stored after every connection
+static void load_records(Restore& thing)
+{
+  // connections from an earlier resume point into the old records
+  for (auto& rc : restored) rc.record = nullptr;
+  records = thing.as_vector<blackout_record> ();
+  records_dropped = 0;
+  for (auto& rc : restored)
+  {
+    auto conn = rc.conn.lock();
+    if (conn == nullptr) continue;
+    for (auto& rec : records)
+    {
+      if (rec.local == conn->local() && rec.remote == conn->remote()) {
+        rc.record = &rec;
+        break;
+      }
+    }
+  }
+}
+
+void blackout_prepare()
+{
+  static bool registered = false;
+  if (registered == false) {
+    LiveUpdate::on_resume(BLACKOUT_SECTION, 0, load_records);
+    // older services did not store the count
+    LiveUpdate::on_resume(BLACKOUT_SECTION, 1,
+      [] (Restore& thing) { records_dropped = thing.as_int(); });
+    registered = true;
+  }
+}
+void blackout_restored(const std::shared_ptr<net::tcp::Connection>& conn)
+{
+  const auto& tcb = conn->tcb();
+  restored.push_back({conn, tcb.SND.NXT, tcb.RCV.NXT, nullptr});
+}
+void blackout_resumed()
+{
+  // connections without a record cannot be accounted for
+  restored.erase(std::remove_if(restored.begin(), restored.end(),
+    [] (const restored_conn& rc) { return rc.record == nullptr; }),
+    restored.end());
+  if (restored.empty() == false && poll_timer < 0) schedule_poll();
+}
+
+blackout_stats LiveUpdate::blackout(size_t top_n)
+{
+  blackout_stats stats {};
+  stats.dropped = records_dropped;
+  std::vector<const blackout_record*> done;
+  for (auto& rec : records)
+  {
+    if (rec.first_sent < 0 || rec.first_received < 0) {
+      stats.pending++;
+      continue;
+    }
+    done.push_back(&rec);
+    int bucket = 0;
+    for (int64_t ms = rec.blackout() / 1000; ms > 0; ms >>= 1) bucket++;
+    stats.histogram[std::min(bucket, blackout_stats::BUCKETS-1)]++;
+  }
+  stats.completed = done.size();
+
+  top_n = std::min(top_n, done.size());
+  std::partial_sort(done.begin(), done.begin() + top_n, done.end(),
+    [] (const blackout_record* a, const blackout_record* b) {
+      return a->blackout() > b->blackout();
+    });
+  for (size_t i = 0; i < top_n; i++)
+    stats.slowest.push_back(*done[i]);
+  return stats;
+}
+
+} // liu
@@ -0,0 +1,87 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#pragma once
+#ifndef LIVEUPDATE_BLACKOUT_HPP
+#define LIVEUPDATE_BLACKOUT_HPP
+
+#include <net/tcp/connection.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+struct storage_header;
+
+namespace liu
+{
+/**
+ * Per-connection blackout accounting.
+ *
+ * Every connection stored with the Storage functions is timestamped as it
+ * is serialized, and the records are stored in the "liu/blackout" section
+ * after every connection. After resume, the restored connections are
+ * polled every millisecond, for up to 30 seconds after boot, until they
+ * have sent and received their first segment. That gives the time each
+ * connection was blacked out by the update, to within a millisecond.
+ *
+ * The blackout starts when the connection is serialized, not at its last
+ * segment before begin(): the TCP stack keeps no per-connection timestamp
+ * of its last segment, so the idle time before the update is not counted.
+ *
+ * The clock starts over in the new service, so the time before the swap is
+ * measured up to the end of the store, and the time after it from boot.
+ * Not available with the legacy storage format, which has no sections.
+ *
+**/
+struct blackout_record
+{
+  net::Socket local;
+  net::Socket remote;
+  // microseconds from serialization to the end of the store
+  int64_t     frozen;
+  // queue depths and serialized size, to correlate with
+  uint32_t    sendq;
+  uint32_t    readq;
+  uint32_t    state_len;
+  uint32_t    reserved;
+  // microseconds from serialization to the first segment sent and
+  // received after resume, or -1 if there has been none yet
+  int64_t     first_sent;
+  int64_t     first_received;
+
+  int64_t blackout() const noexcept {
+    return std::max(first_sent, first_received);
+  }
+};
+
+struct blackout_stats
+{
+  // log2 buckets of blackout time in milliseconds: <1, <2, <4, ...
+  static const int BUCKETS = 16;
+
+  uint32_t histogram[BUCKETS];
+  // connections that have both sent and received after resume
+  size_t   completed;
+  // connections still waiting for their first segments
+  size_t   pending;
+  // connections that were stored without a record, see blackout_reserve()
+  size_t   dropped;
+  // the slowest completed connections, slowest first
+  std::vector<blackout_record> slowest;
+};
+
+// hooks used when connections are stored and restored. Before an update,
+// room is reserved for the records, since the store runs with interrupts
+// disabled. Connections beyond that are only counted as dropped
+void blackout_reserve();
+void blackout_frozen(const net::tcp::Connection&, int state_len);
+void blackout_store(storage_header&);
+void blackout_prepare();
+void blackout_restored(const std::shared_ptr<net::tcp::Connection>&);
+// starts polling the restored connections, once every entry is resumed
+void blackout_resumed();
+
+} // liu
+
+#endif
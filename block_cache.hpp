@@ -0,0 +1,37 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#pragma once
+#ifndef LIVEUPDATE_BLOCK_CACHE_HPP
+#define LIVEUPDATE_BLOCK_CACHE_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+namespace liu
+{
+/**
+ * Block cache handoff for services reading from memdisk or virtio-blk.
+ *
+ * Storage::add_block_cache() stores the cached block numbers as one packed
+ * array, followed by the contents of every cached block back to back.
+ * Restore::as_block_cache() hands each block back to the cache in order,
+ * so that it is warm right after the update.
+ *
+ * Blocks that can cheaply be found again, eg. on a memdisk, can be stored
+ * as references with a null data pointer. Only the block number is stored,
+ * and the block_func is handed a null pointer for it on resume.
+ *
+**/
+struct cached_block
+{
+  uint64_t    block;
+  // the cached contents, or null to store a reference only
+  const void* data;
+};
+
+} // liu
+
+#endif
@@ -0,0 +1,7 @@
+#!/bin/bash
+# usage: build_collector.sh [port]
+set -e
+DIR=$(dirname $0)
+clang++-3.8 -std=c++14 -O2 $DIR/collector.cpp -o collector
+./collector "$@"
+rm -f collector
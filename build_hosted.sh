@@ -0,0 +1,9 @@
+#!/bin/bash
+# compile the hosted-only sources on the host, see LIVEUPDATE_HOSTED
+# usage: build_hosted.sh
+set -e
+DIR=$(dirname $0)
+for src in snapshot.cpp; do
+  clang++-3.8 -std=c++14 -Wall -c $DIR/$src -I$DIR -I$DIR/../IncludeOS/api -o /dev/null
+done
+echo "Hosted sources compile"
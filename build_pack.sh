@@ -0,0 +1,7 @@
+#!/bin/bash
+# usage: build_pack.sh <service> <output>
+set -e
+DIR=$(dirname $0)
+clang++-3.8 -std=c++14 -O2 -msse4.2 $DIR/pack.cpp -I$DIR/../IncludeOS/api -o pack
+./pack "$@"
+rm -f pack
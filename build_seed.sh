@@ -0,0 +1,7 @@
+#!/bin/bash
+# usage: build_seed.sh <output> <id>:<type>:<file> ...
+set -e
+DIR=$(dirname $0)
+clang++-3.8 -std=c++14 -msse4.2 -DLIU_HOST_TOOL $DIR/seed.cpp $DIR/storage.cpp -I$DIR/../IncludeOS/api -o seed
+./seed "$@"
+rm -f seed
@@ -0,0 +1,7 @@
+#!/bin/bash
+# usage: build_sign.sh <keyfile> <image> <output>
+set -e
+DIR=$(dirname $0)
+clang++-3.8 -std=c++14 -O2 $DIR/sign.cpp $DIR/sha256.cpp -o sign
+./sign "$@"
+rm -f sign
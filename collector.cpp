@@ -0,0 +1,71 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+ * Host-side collector for telemetry sent by liu::Telemetry, see
+ * telemetry.hpp. Prints one line per sample as:
+ *   epoch seq timestamp(us) metric value
+ * and reports live updates (epoch changes) and lost samples on stderr.
+ *
+ * Usage: collector [port]
+ *
+**/
+#include "telemetry_wire.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace liu;
+
+int main(int argc, char** argv)
+{
+  const int port = (argc > 1) ? atoi(argv[1]) : 667;
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in addr {};
+  addr.sin_family      = AF_INET;
+  addr.sin_port        = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (fd < 0 || bind(fd, (sockaddr*) &addr, sizeof(addr)) < 0) {
+    perror("bind");
+    return 1;
+  }
+  fprintf(stderr, "Collecting telemetry on port %d\n", port);
+
+  bool     first = true;
+  uint64_t next_seq = 0;
+  uint32_t epoch = 0;
+  char     buffer[65536];
+  while (true)
+  {
+    const ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+    auto* dgram = (const telemetry_datagram*) buffer;
+    if (len < (ssize_t) offsetof(telemetry_datagram, samples)) continue;
+    if (dgram->magic != TELEMETRY_MAGIC || dgram->version != TELEMETRY_VERSION)
+        continue;
+    if (dgram->count > telemetry_datagram::MAX_COUNT
+     || dgram->size() > (size_t) len) continue;
+
+    for (int i = 0; i < dgram->count; i++)
+    {
+      auto& s = dgram->samples[i];
+      if (!first && s.epoch != epoch) {
+        fprintf(stderr, "* Live update: epoch %u -> %u at %lld us\n",
+                epoch, s.epoch, (long long) s.ts);
+      }
+      if (!first && s.seq > next_seq) {
+        fprintf(stderr, "* Lost %llu samples\n",
+                (unsigned long long) (s.seq - next_seq));
+      }
+      printf("%u %llu %lld %u %f\n", s.epoch, (unsigned long long) s.seq,
+             (long long) s.ts, s.metric, s.value);
+      first    = false;
+      epoch    = s.epoch;
+      next_seq = s.seq + 1;
+    }
+    fflush(stdout);
+  }
+}
@@ -0,0 +1,50 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#pragma once
+#ifndef LIVEUPDATE_FLOWS_HPP
+#define LIVEUPDATE_FLOWS_HPP
+
+#include <net/inet4>
+#include <cstdint>
+
+namespace liu
+{
+/**
+ * Connection tracking and NAT tables for routers and firewalls.
+ *
+ * Each table is stored as one packed array with Storage::add_flows() and
+ * Storage::add_nat(), and restored with Restore::as_flows() and
+ * Restore::as_nat(), so that the hash tables can be rebuilt in bulk.
+ * The clock starts over in the new service, so expiry times are
+ * stored as remaining time, and rebased on the new clock when restored.
+ *
+**/
+struct flow_entry
+{
+  // the original direction, and the expected reply direction
+  net::Socket orig_src;
+  net::Socket orig_dst;
+  net::Socket reply_src;
+  net::Socket reply_dst;
+  // expiry time in OS::micros_since_boot()
+  int64_t     expires;
+  uint8_t     proto;
+  uint8_t     state;
+  uint16_t    flags;
+};
+
+struct nat_entry
+{
+  net::Socket internal;
+  net::Socket external;
+  // expiry time in OS::micros_since_boot()
+  int64_t     expires;
+  uint8_t     proto;
+};
+
+} // liu
+
+#endif
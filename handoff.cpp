@@ -0,0 +1,96 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#include "handoff.hpp"
+#include "storage.hpp"
+#include <kernel/os.hpp>
+#include <util/crc32.hpp>
+#include <cstring>
+
+//#define LPRINT(x, ...) printf(x, ##__VA_ARGS__);
+#define LPRINT(x, ...) /** x **/
+
+extern void softreset_service_handler(const void*, size_t);
+// heap area
+extern char* heap_end;
+
+namespace liu
+{
+static solo5_handoff* handoff_block()
+{
+  // the last page of guest memory
+  return (solo5_handoff*) ((OS::heap_max() - 4095) & ~(uintptr_t) 4095);
+}
+static uint32_t handoff_crc(const solo5_handoff* block)
+{
+  return crc32_fast(&block->storage,
+                    sizeof(solo5_handoff) - offsetof(solo5_handoff, storage));
+}
+
+void* store_handoff(const char* storage, std::pair<const char*, size_t> rollback)
+{
+  auto* block = handoff_block();
+  const size_t storage_len = ((const storage_header*) storage)->total_bytes();
+  // called with interrupts disabled, so the caller reports the failure
+  if (storage + storage_len > (char*) block) return nullptr;
+  block->magic        = solo5_handoff::MAGIC;
+  block->version      = 1;
+  block->storage      = (uintptr_t) storage;
+  block->storage_len  = storage_len;
+  block->rollback     = 0;
+  block->rollback_len = 0;
+  // the rollback blob is probably on the heap, which the next guest reuses
+  if (rollback.first != nullptr)
+  {
+    char* copy = (char*) (((uintptr_t) block - rollback.second) & ~(uintptr_t) 4095);
+    // stay clear of the storage, and of the heap holding the new image
+    if (copy >= storage + storage_len && copy >= heap_end) {
+      memmove(copy, rollback.first, rollback.second);
+      block->rollback     = (uintptr_t) copy;
+      block->rollback_len = rollback.second;
+    }
+  }
+  block->crc = handoff_crc(block);
+  LPRINT("* Wrote solo5 handoff block at %p\n", block);
+  return block;
+}
+
+static solo5_handoff handed_over {};
+#ifdef PLATFORM_x86_solo5
+// the rollback blob is installed like a soft-reset one, once the OS
+// is up. It is still at the top of memory, far from the early heap
+static void install_rollback()
+{
+  softreset_service_handler((const void*) handed_over.rollback,
+                            handed_over.rollback_len);
+}
+// only copy the block here, since the OS is not initialized yet
+__attribute__((constructor))
+static void read_handoff()
+{
+  auto* block = handoff_block();
+  if (block->magic != solo5_handoff::MAGIC || block->version != 1
+   || block->crc != handoff_crc(block)) return;
+
+  handed_over = *block;
+  block->magic = 0;
+  if (handed_over.rollback_len > 0) {
+    OS::register_plugin(install_rollback, "LiveUpdate solo5 rollback");
+  }
+}
+#endif
+
+void* handoff_storage() noexcept
+{
+  return (void*) (uintptr_t) handed_over.storage;
+}
+const void* handoff_reserved() noexcept
+{
+  if (handed_over.storage == 0) return nullptr;
+  if (handed_over.rollback_len > 0) return (void*) (uintptr_t) handed_over.rollback;
+  return handoff_block();
+}
+
+} // liu
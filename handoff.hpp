@@ -0,0 +1,60 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#pragma once
+#ifndef LIVEUPDATE_HANDOFF_HPP
+#define LIVEUPDATE_HANDOFF_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+/**
+ * EXPERIMENTAL: only the guest side is implemented. No released solo5
+ * tender provides solo5_exec(), or keeps guest memory across it, so
+ * updates on solo5 need a patched tender and are untested. Do not enable
+ * this in a release before the tender patch exists and an update has
+ * been run end to end on spt.
+ *
+ * State handoff for solo5 (spt and hvt), where begin() has no soft-reset
+ * and replaces the guest with solo5_exec(). The tender is expected to load
+ * the new guest into the same guest memory without clearing it.
+ *
+ * Before the exec, begin() writes a handoff block into the last page of
+ * guest memory, with the location of the storage area. The rollback blob is
+ * copied right below the block when there is room for it. The new guest
+ * reads the block when it starts, and resume() then uses the storage
+ * location that was handed over. The rollback blob is set up the same way
+ * as with a soft-reset, from an OS plugin once the OS is initialized.
+ * resume() moves the storage below the block and the rollback copy, so
+ * that they are intact until then.
+**/
+struct solo5_handoff
+{
+  static const uint64_t MAGIC = 0xbaadb33fdeadf11e;
+
+  uint64_t magic;
+  uint32_t version;
+  uint32_t crc;       // of the fields below
+  uint64_t storage;
+  uint64_t storage_len;
+  uint64_t rollback;
+  uint64_t rollback_len;
+};
+
+namespace liu
+{
+// write the handoff block for the storage area at @storage,
+// and keep a copy of @rollback next to it. Returns the block, or
+// nullptr if the storage area overlaps it. Never allocates or throws
+void* store_handoff(const char* storage, std::pair<const char*, size_t> rollback);
+// the storage location handed over by the previous guest, or nullptr
+void* handoff_storage() noexcept;
+// the lowest address of the handoff block and the rollback copy below it,
+// or nullptr if nothing was handed over
+const void* handoff_reserved() noexcept;
+}
+
+#endif
@@ -0,0 +1,52 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#pragma once
+#ifndef LIVEUPDATE_IMAGE_HPP
+#define LIVEUPDATE_IMAGE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * Compact pre-linked update image, made on the host with pack.cpp.
+ *
+ * The header is followed by the segment table and then only the loadable
+ * bytes of the service, so symbols and debug sections are left out and
+ * begin() does not have to parse ELF headers. The loadable bytes are
+ * checked against crc when LIVEUPDATE_PERFORM_SANITY_CHECKS is enabled.
+ *
+ * The packer merges the PT_LOAD segments into one, since the hotswap
+ * copies a single contiguous area.
+**/
+static const char LIU_IMAGE_MAGIC[8] = {'L','I','U','I','M','G','0','1'};
+
+struct liu_image_segment
+{
+  uint64_t paddr;
+  uint64_t offset;  // from the start of the image
+  uint64_t filesz;
+  uint64_t memsz;
+};
+
+struct liu_image_header
+{
+  char     magic[8];
+  uint64_t entry;
+  uint64_t length;  // total length of the image
+  uint32_t segments;
+  uint32_t crc;     // crc32 of the loadable bytes
+  liu_image_segment segment[0];
+
+  bool is_valid() const noexcept {
+    return memcmp(magic, LIU_IMAGE_MAGIC, sizeof(magic)) == 0;
+  }
+  size_t header_length() const noexcept {
+    return sizeof(liu_image_header) + segments * sizeof(liu_image_segment);
+  }
+};
+
+#endif
@@ -0,0 +1,137 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#include "inflight.hpp"
+#include "liveupdate.hpp"
+#include "storage.hpp"
+#include <kernel/os.hpp>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+//#define LPRINT(x, ...) printf(x, ##__VA_ARGS__);
+#define LPRINT(x, ...) /** x **/
+
+namespace liu
+{
+static const char* INFLIGHT_SECTION = "liu/inflight";
+
+static std::vector<LiveUpdate::capture_func>  capture_funcs;
+static std::vector<LiveUpdate::reinject_func> reinject_funcs;
+static size_t capture_limit = 256 * 1024;
+// packets restored from the storage, waiting to be reinjected
+static buffer_t restored;
+static uint32_t restored_count = 0;
+
+void LiveUpdate::on_capture(capture_func func)
+{
+  capture_funcs.push_back(func);
+}
+void LiveUpdate::on_reinject(reinject_func func)
+{
+  reinject_funcs.push_back(func);
+}
+void LiveUpdate::set_capture_limit(size_t bytes) noexcept
+{
+  capture_limit = bytes;
+}
+
+// the packets written so far, shared with the sink through one pointer
+struct capture_state
+{
+  char*           location;
+  inflight_entry* entry;
+  size_t          used;
+  size_t          limit;
+};
+
+void inflight_store(storage_header& hdr)
+{
+  if (capture_funcs.empty() || hdr.is_legacy()) return;
+  // never write past the end of physical memory. This is the last thing
+  // stored before finalize(), which adds the section index and the end
+  const char* end = (const char*) &hdr + hdr.total_bytes();
+  const size_t room  = OS::heap_max() - (uintptr_t) end;
+  const size_t after = sizeof(storage_entry) + sizeof(section_entry)
+                     + strlen(INFLIGHT_SECTION) + sizeof(storage_entry)
+                     + hdr.finalize_length(1);
+  if (room < after + sizeof(inflight_entry)) return;
+  const size_t limit = std::min(capture_limit, room - after);
+
+  hdr.add_section(INFLIGHT_SECTION, strlen(INFLIGHT_SECTION));
+  hdr.var_entry(TYPE_INFLIGHT, 0,
+  [limit] (char* location) -> int
+  {
+    auto* entry = (inflight_entry*) location;
+    entry->count   = 0;
+    entry->dropped = 0;
+    capture_state state {location, entry, sizeof(inflight_entry), limit};
+    capture_state* st = &state;
+
+    LiveUpdate::packet_sink sink =
+    [st] (packet_dir dir, int ifindex, const void* data, size_t len) -> bool
+    {
+      // the stored index is a single byte
+      if (ifindex < 0 || ifindex > UINT8_MAX || len > UINT16_MAX
+       || st->used + sizeof(inflight_packet) + len > st->limit) {
+        st->entry->dropped++;
+        return false;
+      }
+      auto* pkt = (inflight_packet*) &st->location[st->used];
+      pkt->direction = dir;
+      pkt->ifindex   = ifindex;
+      pkt->len       = len;
+      memcpy(pkt->data, data, len);
+      st->used += pkt->size();
+      st->entry->count++;
+      return true;
+    };
+    for (auto& func : capture_funcs) func(sink);
+
+    LPRINT("* Captured %u packets in flight (%u dropped)\n",
+           entry->count, entry->dropped);
+    return state.used;
+  });
+}
+
+static void load_packets(Restore& thing)
+{
+  if (thing.get_type() != TYPE_INFLIGHT) {
+    throw std::runtime_error("LiveUpdate: Not an in-flight packets entry");
+  }
+  auto* entry = (const inflight_entry*) thing.data();
+  const size_t len = thing.length() - sizeof(inflight_entry);
+  // the storage is zeroed after resume, so keep a copy until reinjection
+  restored.insert(restored.end(), entry->vla, entry->vla + len);
+  restored_count += entry->count;
+}
+
+void inflight_prepare()
+{
+  static bool registered = false;
+  if (registered == false) {
+    LiveUpdate::on_resume(INFLIGHT_SECTION, 0, load_packets);
+    registered = true;
+  }
+}
+
+void inflight_reinject()
+{
+  if (restored_count == 0) return;
+  LPRINT("* Reinjecting %u packets in flight\n", restored_count);
+  const char* ptr = restored.data();
+  for (uint32_t i = 0; i < restored_count; i++)
+  {
+    auto* pkt = (const inflight_packet*) ptr;
+    for (auto& func : reinject_funcs) {
+      func((packet_dir) pkt->direction, pkt->ifindex, pkt->data, pkt->len);
+    }
+    ptr += pkt->size();
+  }
+  restored.clear();
+  restored_count = 0;
+}
+
+} // liu
@@ -0,0 +1,38 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#pragma once
+#ifndef LIVEUPDATE_INFLIGHT_HPP
+#define LIVEUPDATE_INFLIGHT_HPP
+
+struct storage_header;
+
+namespace liu
+{
+/**
+ * Packets in flight during the update window.
+ *
+ * Packets that arrive after the storage callback has run, or that are
+ * still queued for transmission after the devices have been flushed, are
+ * lost with the old kernel, and TCP would have to retransmit them. Instead,
+ * the registered capture handlers hand them over at the final cut-over,
+ * and they are stored in the "liu/inflight" section, up to the capture
+ * limit. After the connections have been resumed and the IP stacks have
+ * been woken up, the packets are passed to the reinject handlers in the
+ * order they were captured: received packets go up the new stack, and
+ * transmitted ones go out again.
+ *
+ * Not available with the legacy storage format, which has no sections.
+ *
+**/
+
+// hooks used when storing and resuming
+void inflight_store(storage_header&);
+void inflight_prepare();
+void inflight_reinject();
+
+} // liu
+
+#endif
@@ -0,0 +1,169 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#include "journal.hpp"
+#include "storage.hpp"
+#include <util/crc32.hpp>
+#include <timers>
+#include <algorithm>
+#include <cstring>
+
+//#define LPRINT(x, ...) printf(x, ##__VA_ARGS__);
+#define LPRINT(x, ...) /** x **/
+
+const uint64_t journal_header::JOURNAL_MAGIC = 0xbaadb33fdeadf00d;
+
+namespace liu
+{
+Journal::Journal(void* location, size_t capacity)
+  : hdr((journal_header*) location), cap(capacity) {}
+Journal::Journal(Journal&& other) noexcept
+  : hdr(other.hdr), cap(other.cap)
+{
+  other.stop_compacting();
+}
+Journal& Journal::operator= (Journal&& other) noexcept
+{
+  stop_compacting();
+  other.stop_compacting();
+  hdr = other.hdr;
+  cap = other.cap;
+  return *this;
+}
+Journal::~Journal()
+{
+  stop_compacting();
+}
+
+void* Journal::base_location() const noexcept
+{
+  // the base snapshot starts on the first page after the log
+  uintptr_t end = (uintptr_t) hdr->log.begin() + cap;
+  return (void*) ((end + 4095) & ~(uintptr_t) 4095);
+}
+size_t Journal::extent() const noexcept
+{
+  auto* base = (storage_header*) base_location();
+  size_t len = sizeof(storage_header);
+  if (base->has_magic()) len = std::max(len, base->total_bytes());
+  return (char*) base - (char*) hdr + len;
+}
+size_t Journal::length() const noexcept
+{
+  return hdr->log.get_length();
+}
+uint32_t Journal::records() const noexcept
+{
+  return hdr->log.get_entries();
+}
+
+void Journal::reset()
+{
+  hdr->magic     = journal_header::JOURNAL_MAGIC;
+  hdr->running   = CRC32_BEGIN();
+  hdr->sealed    = 0;
+  hdr->is_sealed = 0;
+  hdr->capacity  = cap;
+  new (&hdr->log) storage_header();
+  hdr->log.append_eof();
+  // invalidate the old base snapshot
+  memset(base_location(), 0, sizeof(storage_header));
+}
+
+bool Journal::append(uint16_t id, const void* data, size_t len) noexcept
+{
+  auto& log = hdr->log;
+  // room for this record and the END entry after it
+  if (log.get_length() + 2 * sizeof(storage_entry) + len > cap) return false;
+
+  auto& entry = log.add_struct(TYPE_BUFFER, id, len);
+  memcpy(entry.vla, data, len);
+  hdr->running   = crc32(hdr->running, (const char*) &entry, entry.size());
+  hdr->is_sealed = 0;
+  return true;
+}
+
+void Journal::compact(LiveUpdate::storage_func func)
+{
+  LiveUpdate::store(base_location(), func);
+  // the base now contains everything in the log
+  hdr->running   = CRC32_BEGIN();
+  hdr->is_sealed = 0;
+  new (&hdr->log) storage_header();
+  hdr->log.append_eof();
+  LPRINT("* Journal compacted into base at %p\n", base_location());
+}
+void Journal::compact_every(std::chrono::milliseconds interval,
+                            LiveUpdate::storage_func func)
+{
+  stop_compacting();
+  timer = Timers::periodic(interval,
+    [this, func] (int) {
+      this->compact(func);
+    });
+}
+
+void Journal::stop_compacting() noexcept
+{
+  if (timer >= 0) Timers::stop(timer);
+  timer = -1;
+}
+
+void Journal::seal() noexcept
+{
+  hdr->sealed    = CRC32_VALUE(hdr->running);
+  hdr->is_sealed = 1;
+}
+bool Journal::is_resumable() const
+{
+  if (hdr->magic != journal_header::JOURNAL_MAGIC) return false;
+  if (hdr->is_sealed == 0 || hdr->capacity != cap) return false;
+  if (hdr->log.get_length() > cap) return false;
+
+  uint32_t csum = crc32(CRC32_BEGIN(), (const char*) hdr->log.begin(),
+                        hdr->log.get_length());
+  return CRC32_VALUE(csum) == hdr->sealed;
+}
+
+bool Journal::replay(LiveUpdate::resume_func base_func,
+                     LiveUpdate::resume_func record_func)
+{
+  if (is_resumable() == false) return false;
+
+  void* base = base_location();
+  if (LiveUpdate::is_resumable(base)) {
+    if (LiveUpdate::resume(base, base_func) == false) return false;
+  }
+  LPRINT("* Replaying %u journal records\n", records());
+  for (auto* ptr = hdr->log.begin(); ptr->type != TYPE_END;)
+  {
+    auto* oldptr = ptr;
+    Restore wrapper {ptr};
+    record_func(wrapper);
+    if (ptr->type == TYPE_END) break;
+    if (oldptr == ptr) ptr = ptr->next();
+  }
+  reset();
+  return true;
+}
+
+void Storage::add_journal(uid id, Journal& journal)
+{
+  journal.seal();
+  auto& entry = hdr.add_struct(TYPE_JOURNAL, id, sizeof(journal_entry));
+  auto* jent = (journal_entry*) entry.vla;
+  jent->location = (uintptr_t) journal.location();
+  jent->capacity = journal.capacity();
+}
+
+Journal Restore::as_journal() const
+{
+  if (ent->type != TYPE_JOURNAL)
+      throw std::runtime_error("Incorrect type: " + std::to_string(ent->type));
+  auto* jent = (const journal_entry*) ent->vla;
+  return Journal((void*) (uintptr_t) jent->location, jent->capacity);
+}
+
+} // liu
@@ -0,0 +1,91 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#pragma once
+#ifndef LIVEUPDATE_JOURNAL_HPP
+#define LIVEUPDATE_JOURNAL_HPP
+
+#include "liveupdate.hpp"
+#include <chrono>
+
+struct journal_header;
+
+namespace liu
+{
+/**
+ * A Journal is an append-only log of small mutation records living in a
+ * fixed memory area, followed by a base snapshot of the full state.
+ *
+ * Applications append a record for each change to their state, and
+ * periodically compact() it, which stores a new base snapshot with the
+ * given storage function and empties the log. Compacting is not
+ * incremental, and blocks for as long as storing the full state takes.
+ * Storing the journal during an update with Storage::add_journal() only
+ * seals the log, which is O(1).
+ *
+ * After the update, Restore::as_journal() gives back the journal, and
+ * replay() resumes the base snapshot followed by every logged record.
+ *
+ * Records use the regular storage entry format, so they are restored with
+ * the usual Restore functions, eg. as_type<T>() or as_buffer().
+ *
+**/
+struct Journal
+{
+  // attach to a journal at @location with room for @capacity bytes of
+  // records, followed by the base snapshot. Call reset() to start a new one
+  Journal(void* location, size_t capacity);
+  // the compaction timer refers to this object, so it is stopped when
+  // the journal is destroyed or moved from, and journals are not copied
+  Journal(Journal&&) noexcept;
+  Journal& operator= (Journal&&) noexcept;
+  Journal(const Journal&) = delete;
+  Journal& operator= (const Journal&) = delete;
+  ~Journal();
+
+  // start over with an empty log and no base snapshot
+  void reset();
+
+  // log a mutation record, returns false if the log is full
+  bool append(uint16_t id, const void*, size_t) noexcept;
+  template <typename T>
+  bool append(uint16_t id, const T& record) noexcept {
+    return append(id, &record, sizeof(T));
+  }
+
+  // store the full state as the new base snapshot and empty the log
+  void compact(LiveUpdate::storage_func);
+  // compact periodically from the event loop, until stopped. Each
+  // compaction is a blocking checkpoint: the whole state is stored
+  // synchronously from the timer, and nothing else runs meanwhile
+  void compact_every(std::chrono::milliseconds, LiveUpdate::storage_func);
+  void stop_compacting() noexcept;
+
+  // seal the log so that it can be replayed after an update
+  void seal() noexcept;
+  // true if the log is sealed and its checksum matches
+  bool is_resumable() const;
+  // resume the base snapshot, calling @base_func for entries without
+  // a registered handler, and then call @record_func for every record
+  bool replay(LiveUpdate::resume_func base_func, LiveUpdate::resume_func record_func);
+
+  void*    location() const noexcept { return hdr; }
+  size_t   capacity() const noexcept { return cap; }
+  // bytes from location() to the end of the base snapshot
+  size_t   extent()   const noexcept;
+  size_t   length()   const noexcept;
+  uint32_t records()  const noexcept;
+
+private:
+  void* base_location() const noexcept;
+
+  journal_header* hdr;
+  size_t          cap;
+  int             timer = -1;
+};
+
+} // liu
+
+#endif
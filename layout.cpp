@@ -0,0 +1,84 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#include "layout.hpp"
+
+namespace liu
+{
+static bool is_integer(uint8_t kind) noexcept
+{
+  return kind == FIELD_SIGNED || kind == FIELD_UNSIGNED;
+}
+
+static int64_t read_signed(const void* src, int size) noexcept
+{
+  switch (size) {
+  case 1: return *(const int8_t*)  src;
+  case 2: return *(const int16_t*) src;
+  case 4: return *(const int32_t*) src;
+  case 8: return *(const int64_t*) src;
+  }
+  return 0;
+}
+static uint64_t read_unsigned(const void* src, int size) noexcept
+{
+  switch (size) {
+  case 1: return *(const uint8_t*)  src;
+  case 2: return *(const uint16_t*) src;
+  case 4: return *(const uint32_t*) src;
+  case 8: return *(const uint64_t*) src;
+  }
+  return 0;
+}
+static double read_float(const void* src, int size) noexcept
+{
+  if (size == sizeof(float))  return *(const float*) src;
+  if (size == sizeof(double)) return *(const double*) src;
+  return 0.0;
+}
+
+bool convert_field(void* dst, const layout_field& to,
+                   const void* src, const layout_field& from) noexcept
+{
+  // identical fields are simply copied
+  if (to.kind == from.kind && to.size == from.size) {
+    memcpy(dst, src, to.size);
+    return true;
+  }
+  if (to.kind == FIELD_BLOB || from.kind == FIELD_BLOB) return false;
+  if (to.size > 8 || from.size > 8) return false;
+
+  if (is_integer(to.kind))
+  {
+    uint64_t value;
+    if (from.kind == FIELD_SIGNED)
+        value = read_signed(src, from.size);
+    else if (from.kind == FIELD_UNSIGNED)
+        value = read_unsigned(src, from.size);
+    else
+        value = (int64_t) read_float(src, from.size);
+    // little-endian: the low bytes come first
+    memcpy(dst, &value, to.size);
+    return true;
+  }
+  // floating point destination
+  double value;
+  if (from.kind == FIELD_SIGNED)
+      value = read_signed(src, from.size);
+  else if (from.kind == FIELD_UNSIGNED)
+      value = read_unsigned(src, from.size);
+  else
+      value = read_float(src, from.size);
+
+  if (to.size == sizeof(float))
+      *(float*) dst = value;
+  else if (to.size == sizeof(double))
+      *(double*) dst = value;
+  else
+      return false;
+  return true;
+}
+
+} // liu
@@ -0,0 +1,108 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#pragma once
+#ifndef LIVEUPDATE_LAYOUT_HPP
+#define LIVEUPDATE_LAYOUT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+#include <delegate>
+
+namespace liu
+{
+/**
+ * A layout descriptor records the name, offset, size and kind of each
+ * field of a stored struct. It is stored together with the struct by
+ * Storage::add_struct(), so that Restore::as_struct() can convert the
+ * data field by field when the struct has changed between updates.
+ *
+ * Describe a type once, at global scope:
+ *   LIU_LAYOUT(measurement_t,
+ *       LIU_FIELD(measurement_t, received),
+ *       LIU_FIELD(measurement_t, ts))
+ *
+ * Fields are matched by name. New fields keep the value they have after
+ * value-initialization, removed fields are ignored, and integer or floating
+ * point fields that changed size or kind are converted automatically.
+ * Anything else can be handled by a converter registered with
+ * LiveUpdate::on_convert().
+**/
+enum field_kind : uint8_t
+{
+  FIELD_SIGNED   = 1,
+  FIELD_UNSIGNED = 2,
+  FIELD_FLOAT    = 3,
+  FIELD_BLOB     = 4,
+};
+
+struct layout_field
+{
+  static const int NAME_LEN = 24;
+
+  char     name[NAME_LEN];
+  uint32_t offset;
+  uint16_t size;
+  uint8_t  kind;
+  uint8_t  reserved;
+};
+typedef std::vector<layout_field> layout_t;
+
+// convert stored field @from at @src into field @to at @dst
+typedef delegate<void(void* dst, const layout_field& to,
+                      const void* src, const layout_field& from)> field_converter;
+
+// automatic conversion between integers and floating point numbers
+// returns false if the fields could not be converted
+bool convert_field(void* dst, const layout_field& to,
+                   const void* src, const layout_field& from) noexcept;
+
+template <typename F, bool = std::is_enum<F>::value>
+struct field_kind_of
+{
+  static const uint8_t value =
+      std::is_floating_point<F>::value ? FIELD_FLOAT :
+      std::is_integral<F>::value ?
+          (std::is_signed<F>::value ? FIELD_SIGNED : FIELD_UNSIGNED) :
+      FIELD_BLOB;
+};
+template <typename F>
+struct field_kind_of<F, true>
+  : field_kind_of<typename std::underlying_type<F>::type> {};
+
+template <typename F>
+inline layout_field make_field(const char* name, size_t offset)
+{
+  layout_field field {};
+  strncpy(field.name, name, layout_field::NAME_LEN-1);
+  field.offset = offset;
+  field.size   = sizeof(F);
+  field.kind   = field_kind_of<F>::value;
+  return field;
+}
+
+// specialized for each stored type with LIU_LAYOUT
+template <typename T>
+struct layout_of;
+
+} // liu
+
+#define LIU_FIELD(T, member) \
+    liu::make_field<decltype(T::member)>(#member, offsetof(T, member))
+
+#define LIU_LAYOUT(T, ...)                                \
+  namespace liu {                                         \
+  template <> struct layout_of<T> {                       \
+    static const char* name() noexcept { return #T; }     \
+    static const layout_t& fields() {                     \
+      static const layout_t layout { __VA_ARGS__ };       \
+      return layout;                                      \
+    }                                                     \
+  }; }
+
+#endif
@@ -0,0 +1,54 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#pragma once
+#ifndef LIVEUPDATE_LEASE_HPP
+#define LIVEUPDATE_LEASE_HPP
+
+#include <net/inet4>
+#include <delegate>
+#include <string>
+
+namespace liu
+{
+/**
+ * The active DHCP lease and the DNS resolver cache, stored with
+ * Storage::add_lease() and Storage::add_dns_cache(), so that the new
+ * service can configure its network instantly with apply_lease(),
+ * instead of negotiating a new lease and resolving every name again.
+ *
+ * Times are stored as remaining time, and rebased on the new clock.
+ *
+**/
+struct dhcp_lease
+{
+  net::ip4::Addr address;
+  net::ip4::Addr netmask;
+  net::ip4::Addr gateway;
+  net::ip4::Addr dns;
+  net::ip4::Addr server;
+  // renewal (T1) and expiry time in OS::micros_since_boot()
+  int64_t        renew;
+  int64_t        expires;
+};
+
+struct dns_record
+{
+  std::string    name;
+  net::ip4::Addr addr;
+  // expiry time in OS::micros_since_boot()
+  int64_t        expires;
+};
+
+// configure @inet from a restored lease, and call @on_renew when the lease
+// is due for renewal (immediately, if it already is). If the lease expired
+// during the update, @inet negotiates a new one with DHCP instead, and
+// false is returned
+bool apply_lease(net::Inet<net::IP4>& inet, const dhcp_lease&,
+                 delegate<void()> on_renew);
+
+} // liu
+
+#endif
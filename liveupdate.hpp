@@ -9,16 +9,45 @@
 
 #include <net/tcp/connection.hpp>
 #include <delegate>
+#include <chrono>
+#include "layout.hpp"
 #include <string>
 #include <vector>
 struct storage_entry;
 struct storage_header;
+namespace hw { class Block_device; }
+// seed storage image embedded with LIVEUPDATE_SEED, see LiveUpdate::seed()
+extern "C" const char     liu_seed_image[];
+extern "C" const uint32_t liu_seed_image_len;
 
 namespace liu
 {
 struct Storage;
 struct Restore;
+struct Arena;
+struct Journal;
+struct Snapshot;
+struct flow_entry;
+struct nat_entry;
+struct dhcp_lease;
+struct dns_record;
+struct cached_block;
+struct tls_state;
+struct ticket_key;
+struct Telemetry;
+struct blackout_stats;
+struct verified_image;
 typedef std::vector<char> buffer_t;
+// direction of packets in flight at the final cut-over, see inflight.hpp
+enum packet_dir : uint8_t {
+  PACKET_RX = 0,
+  PACKET_TX = 1
+};
+// called with the connections and metadata of each restored session
+typedef delegate<void(std::vector<net::tcp::Connection_ptr>&,
+                      const void* meta, size_t len)> session_func;
+// called for each restored cache block, with null @data for references
+typedef delegate<void(uint64_t block, const void* data, size_t len)> block_func;
 
 /**
  * The beginning and the end of the LiveUpdate process is the begin() and resume() functions.
@@ -34,10 +63,81 @@ struct LiveUpdate
   // If the parameter is null, you can assume that it's currently not a live update.
   typedef delegate<void(Storage&, const buffer_t*)> storage_func;
   typedef delegate<void(Restore&)> resume_func;
+  typedef delegate<void()> ready_func;
+  typedef delegate<void(ready_func)> prepare_func;
+  typedef delegate<void(const std::exception&)> error_func;
+  typedef delegate<void(buffer_t&)> image_func;
+  // returns false when the packet did not fit, and was dropped. Packets
+  // from interfaces with an index above 255 are always dropped
+  typedef delegate<bool(packet_dir, int ifindex, const void*, size_t)> packet_sink;
+  typedef delegate<void(packet_sink)> capture_func;
+  typedef delegate<void(packet_dir, int ifindex, const void*, size_t)> reinject_func;
+  // enough of the beginning of an image to determine its length
+  static const size_t IMAGE_HEADER_LEN = 1024;
 
   // Start a live update process, storing all user-defined data
   // at @location, which can then be resumed by the future service after update
   static void begin(void* location, buffer_t blob, storage_func = nullptr);
+  // As above, for an image that was verified while streaming in, see
+  // signature.hpp. The image is not hashed again as long as @blob is the
+  // buffer that was verified, so move it into begin() rather than copying
+  static void begin(void* location, buffer_t blob, const verified_image&,
+                    storage_func = nullptr);
+
+  // Register a subsystem that has to settle before its state can be stored,
+  // eg. flushing to disk or handing off to a peer. The handler may yield back
+  // to the event loop, and must eventually call the ready function it is given.
+  // Handlers are run one at a time, in the order they were registered.
+  static void on_prepare(prepare_func);
+
+  // Asynchronous version of begin(), which first runs all prepare handlers,
+  // and only enters begin() once every subsystem has reported ready.
+  // Failures are reported to @on_error, with interrupts enabled again.
+  // Since they happen from the event loop, @on_error is required, and
+  // begin_async() throws right away without it
+  static void begin_async(void* location, buffer_t blob,
+                          storage_func, error_func on_error);
+  // Abandon the update being prepared, without calling its error handler.
+  // Returns false if there was none. Prepare handlers that are still
+  // working may call their ready function, which is then ignored
+  static bool cancel_async() noexcept;
+  // Fail updates with a prepare handler that has not reported ready
+  // within @timeout (10 seconds by default)
+  static void set_prepare_timeout(std::chrono::milliseconds timeout) noexcept;
+
+  // Require update blobs, including rollback blobs, to be authenticated with
+  // the shared @key, see signature.hpp. begin() then rejects images without
+  // a valid authentication trailer
+  static void set_verification_key(const void* key, size_t len);
+  static bool has_verification_key() noexcept;
+  // Returns true if @blob carries a valid authentication trailer
+  static bool verify_image(const buffer_t& blob);
+
+  // Returns the length of the update image starting with @header, which must
+  // be at least IMAGE_HEADER_LEN bytes, not counting any signature trailer.
+  // Returns zero if the image format is not recognized
+  static size_t image_length(const void* header);
+
+  // Read an update image from a block device, starting at @block, using
+  // large asynchronous multi-block reads. @on_loaded is called with the
+  // whole image, which can then be passed on to begin(). Failures are
+  // reported to @on_error from the event loop, so it is required
+  static void load_image(hw::Block_device&, uint64_t block,
+                         image_func on_loaded, error_func on_error);
+
+  // Storage format versions, see storage_header
+  enum storage_format : uint16_t {
+    // readable by releases from before versioned storage,
+    // but without sections and the section index
+    FORMAT_LEGACY  = 1,
+    FORMAT_CURRENT = 2,
+  };
+  // Write stored data in an older @format, eg. when updating or rolling back
+  // to an older release. Structs are stored without their layout in the
+  // legacy format, and storing anything else the format cannot represent,
+  // eg. sections, arenas or telemetry, fails the store
+  static void set_target_format(storage_format);
+  static storage_format get_target_format() noexcept;
 
   // In the event that LiveUpdate::begin() fails,
   // call this function in the C++ exception handler:
@@ -52,9 +152,50 @@ struct LiveUpdate
   // complete and consistent
   static bool is_resumable(void* location);
 
+  // Install a prebuilt storage image (see seed.cpp) at @location, unless
+  // there is already resumable data there. When built with LIVEUPDATE_SEED
+  // the image is available as liu_seed_image and liu_seed_image_len.
+  // Returns true if the seed was installed, and resume() can proceed as normal
+  static bool seed(void* location, const void* image, size_t length);
+
   // Register a user-defined handler for what to do with @id from storage
   static void on_resume(uint16_t id, resume_func custom_handler);
 
+  // Register a handler for @id inside the section named @section
+  static void on_resume(const std::string& section, uint16_t id, resume_func custom_handler);
+
+  // Register a handler for @id inside the section named @section, for
+  // pure-data sections that need neither devices nor the network, eg.
+  // caches and tables. It is called by resume_early() instead of resume()
+  static void on_resume_early(const std::string& section, uint16_t id, resume_func custom_handler);
+
+  // Start decoding the sections with early handlers at @location, before
+  // the service has set up its network stacks. The storage is first moved
+  // to the top of memory, out of the way of the heap. resume() waits for
+  // the early phase to finish, rethrows its failures, and skips the entries
+  // it has decoded. Restore::section() is not available to early handlers.
+  // With INCLUDEOS_SMP_ENABLE and more than one CPU, the early handlers
+  // run on another core, while this one goes on towards resume(). They may
+  // only allocate if the kernel heap is locked for SMP, and must not touch
+  // anything the boot core uses. Otherwise they run right away, on the
+  // boot core, which saves nothing over decoding in resume().
+  // The secondary CPUs are not started until the OS is initialized, so
+  // calling this from a global constructor always takes the slow path. Use
+  // resume_early_at_boot() instead. How much of the decode is hidden has
+  // not been measured
+  static void resume_early(void* location);
+  // Call resume_early(@location) from an OS plugin, which runs once the
+  // secondary CPUs are up, and before Service::start(). Call this from a
+  // global constructor. The drivers are already initialized by then, so
+  // the decode overlaps the rest of the boot up to resume(), not the
+  // device setup
+  static void resume_early_at_boot(void* location);
+
+  // Register a converter for @field of the struct named @type, used by
+  // Restore::as_struct() when the stored layout differs from the current one.
+  // For fields that did not exist before the update, the source is null
+  static void on_convert(const std::string& type, const std::string& field, field_converter);
+
   // Attempt to restore existing stored entries from fixed location.
   // Returns false if there was nothing there. or if the process failed
   // to be sure that only failure can return false, use is_resumable first
@@ -68,6 +209,21 @@ struct LiveUpdate
   // Never returns zero
   static size_t stored_data_length(void* location);
 
+  // Capture packets that are still pending in receive rings and transmit
+  // queues at the final cut-over, after the devices have been flushed, and
+  // reinject them into the new service right after the connections have
+  // been resumed. Capture handlers hand each packet to the sink they are
+  // given, with interrupts disabled, and reinject handlers are called with
+  // every captured packet, see inflight.hpp
+  static void on_capture(capture_func);
+  static void on_reinject(reinject_func);
+  // At most @bytes of packets are captured, the rest are dropped
+  static void set_capture_limit(size_t bytes) noexcept;
+
+  // Per-connection blackout of the last update, with a histogram and the
+  // @top_n slowest connections, see blackout.hpp
+  static blackout_stats blackout(size_t top_n = 10);
+
   // Set location of known good blob to rollback to if something happens
   static void set_rollback_blob(const void*, size_t) noexcept;
   // Returns true if a backup rollback blob has been set
@@ -84,7 +240,19 @@ struct LiveUpdate
 // Calls to resume can fail even if is_resumable validates everything correctly.
 // this is because when the user restores all the saved data, it could grow into
 // the storage area used by liveupdate, if enough data is stored, and corrupt it.
+// To make this unlikely, resume() moves the storage to the top of memory before
+// any handler runs, below any journal stored with add_journal(), which stays
+// in place. Resume fails if the storage overlaps such a journal. Nothing
+// protects it beyond that, so a heap that grows all the way up to it still
+// corrupts it. Pointers into the storage, eg. from Restore::as_type(), are
+// only valid until the handler returns.
 // All failures are of type std::runtime_error. Make sure to give VM enough RAM!
+//
+// The storage callback given to begin() runs with interrupts disabled, and
+// should not allocate: the heap is slow and may deadlock there. Build the
+// data to be stored beforehand, and use the overloads taking pointers and
+// lengths instead of temporary strings and vectors. Configure with
+// -DLIVEUPDATE_DEBUG_ALLOC=ON to make begin() fail on any such allocation.
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -96,6 +264,12 @@ struct LiveUpdate
  * as a marker to be able to recognize the object when restoring data.
  * IDs don't have to have specific values, and the user is free to use any value.
  *
+ * Independent libraries can each get a private id space by calling section()
+ * with a unique name, eg. "tcp/terminals". All entries added after that call
+ * belong to the section, until section() or end_section() is called, or the
+ * storage callback returns. The empty name is the global section, which is
+ * where entries go by default.
+ *
  * When using the add() function, the type cannot be verified on the other side,
  * simply because type_info isn't guaranteed to work across updates. A new update
  * could have been compiled with a different compiler.
@@ -108,10 +282,15 @@ struct Storage
 
   template <typename T>
   inline void add(uid, const T& type);
+  // store a struct together with its layout descriptor (see layout.hpp),
+  // so that it can be restored even if the struct changes between updates
+  template <typename T>
+  inline void add_struct(uid, const T& type);
 
   // storing as int saves some storage space compared to all the other types
   void add_int   (uid, int value);
   void add_string(uid, const std::string&);
+  void add_string(uid, const char*, size_t length);
   void add_buffer(uid, const buffer_t&);
   void add_buffer(uid, const void*, size_t length);
   // store vectors of PODs or std::string
@@ -119,16 +298,53 @@ struct Storage
   inline void add_vector(uid, const std::vector<T>& vector);
   // store a TCP connection
   void add_connection(uid, Connection_ptr);
+  // store a TCP connection with the TLS stream on top of it, including
+  // buffered records in each direction, see tls.hpp
+  void add_tls_connection(uid, Connection_ptr, const tls_state&,
+                          const buffer_t& pending_in, const buffer_t& pending_out);
+  // store session ticket keys, so that old sessions can be resumed
+  void add_ticket_keys(uid, const std::vector<ticket_key>&);
+  // store linked connections, eg. the client and backend connections of
+  // a proxy, together with per-session metadata as one packed unit
+  void add_session(uid, const std::vector<Connection_ptr>&, const void* meta, size_t len);
+  template <typename M>
+  inline void add_session(uid, const std::vector<Connection_ptr>&, const M& meta);
+  // without a vector, eg. from a std::array kept in the session itself
+  void add_session(uid, const Connection_ptr*, size_t count, const void* meta, size_t len);
+  // store an arena, copying only pages modified since its last snapshot
+  void add_arena(uid, Arena&);
+  // seal a journal and store where it is, see journal.hpp
+  void add_journal(uid, Journal&);
+  // store connection tracking and NAT tables, see flows.hpp
+  void add_flows(uid, const flow_entry*, size_t count);
+  void add_nat  (uid, const nat_entry*,  size_t count);
+  // store the DHCP lease and DNS cache, see lease.hpp
+  void add_lease(uid, const dhcp_lease&);
+  void add_dns_cache(uid, const std::vector<dns_record>&);
+  // store cached disk blocks in bulk, see block_cache.hpp
+  void add_block_cache(uid, size_t block_size, const cached_block*, size_t count);
+  // store the telemetry sequence, epoch and unsent samples, see telemetry.hpp
+  void add_telemetry(uid, Telemetry&);
+  // store where a completed snapshot is, see snapshot.hpp (hosted only)
+  void add_snapshot(uid, Snapshot&);
+
+  // start a named section with its own id space
+  Storage& section(const std::string& name);
+  Storage& section(const char* name);
+  // go back to the global section, done when the storage callback returns
+  void end_section();
 
   Storage(storage_header& sh) : hdr(sh) {}
   void add_vector (uid, const void*, size_t count, size_t element_size);
   void add_string_vector (uid, const std::vector<std::string>&);
+  void add_struct (uid, const char* type, const layout_t&, const void*, size_t);
 
   // markers are used to delineate the end of variable-length structures
   void put_marker(uid);
 
 private:
   storage_header& hdr;
+  bool in_section = false;
 };
 
 /**
@@ -151,13 +367,41 @@ struct Restore
   bool  is_end()    const noexcept;
   bool  is_int()    const noexcept;
   bool  is_marker() const noexcept;
+  // stored with add_struct, as opposed to add
+  bool  is_struct() const noexcept;
   int            as_int()    const;
   std::string    as_string() const;
   buffer_t       as_buffer() const;
   Connection_ptr as_tcp_connection(net::TCP&) const;
+  Connection_ptr as_tls_connection(net::TCP&, tls_state&,
+                                   buffer_t& pending_in, buffer_t& pending_out) const;
+  std::vector<ticket_key> as_ticket_keys() const;
+  // restore the connections of a session together with its metadata
+  void           as_session(net::TCP&, session_func) const;
+  // restore this and every following session with the same id in the
+  // same section in bulk, leaving the restore at the first entry after them
+  size_t         as_sessions(net::TCP&, session_func);
+  // copy a stored arena back into @arena, which must have the same size
+  void           as_arena(Arena&) const;
+  Journal        as_journal() const;
+  std::vector<flow_entry> as_flows() const;
+  std::vector<nat_entry>  as_nat()   const;
+  dhcp_lease              as_lease() const;
+  std::vector<dns_record> as_dns_cache() const;
+  // hand every stored block back to @adopt, returns the number of blocks
+  size_t                  as_block_cache(block_func adopt) const;
+  // continue the telemetry sequence in @telemetry, before taking samples
+  void                    as_telemetry(Telemetry&) const;
+  // map a snapshot again, returning its storage area (hosted only)
+  void*                   as_snapshot() const;
 
   template <typename S>
   inline const S& as_type() const;
+  // restore a struct stored with add_struct, converting field by field
+  // when the stored layout differs from the current one. Structs stored in
+  // the legacy format have no layout, and must have the same size
+  template <typename S>
+  inline S as_struct() const;
 
   template <typename T>
   inline std::vector<T> as_vector() const;
@@ -168,7 +412,13 @@ struct Restore
   const void* data()     const noexcept;
 
   uint16_t    next_id()  const noexcept;
-  // go to the next storage entry
+
+  // go to the first entry of the section named @name, using the
+  // section index stored with the data. Returns false if there is no
+  // such section after the current entry, since sections can only be
+  // jumped forward to. Entries skipped over are not passed to any handler
+  bool        section(const std::string& name);
+  // go to the next storage entry, past any section boundaries
   void        go_next();
 
   // go *past* the first marker found (or end reached)
@@ -193,6 +443,7 @@ struct Restore
 private:
   const void* get_segment(size_t, size_t&) const;
   std::vector<std::string> rebuild_string_vector() const;
+  void rebuild_struct(void*, size_t, const char* type, const layout_t&) const;
   storage_entry*& ent;
 };
 
@@ -205,6 +456,12 @@ inline const S& Restore::as_type() const {
   }
   return *reinterpret_cast<const S*> (data());
 }
+template <typename S>
+inline S Restore::as_struct() const {
+  S result {};
+  rebuild_struct(&result, sizeof(S), layout_of<S>::name(), layout_of<S>::fields());
+  return result;
+}
 template <typename T>
 inline std::vector<T> Restore::as_vector() const
 {
@@ -224,6 +481,16 @@ inline void Storage::add(uid id, const T& thing)
   add_buffer(id, &thing, sizeof(T));
 }
 template <typename T>
+inline void Storage::add_struct(uid id, const T& thing)
+{
+  add_struct(id, layout_of<T>::name(), layout_of<T>::fields(), &thing, sizeof(T));
+}
+template <typename M>
+inline void Storage::add_session(uid id, const std::vector<Connection_ptr>& conns, const M& meta)
+{
+  add_session(id, conns, &meta, sizeof(M));
+}
+template <typename T>
 inline void Storage::add_vector(uid id, const std::vector<T>& vector)
 {
   add_vector(id, vector.data(), vector.size(), sizeof(T));
@@ -0,0 +1,137 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+ * Host-side tool that turns a service ELF binary into a compact
+ * pre-linked update image, see image.hpp.
+ *
+ * Usage: pack <service> <output>
+ *
+**/
+#include "image.hpp"
+#include "elf.h"
+#include <util/crc32.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static const int SECT_SIZE = 512;
+
+static std::vector<char> load_file(const char* path)
+{
+  FILE* f = fopen(path, "rb");
+  if (f == nullptr) {
+    perror(path);
+    exit(1);
+  }
+  std::vector<char> data;
+  char buffer[65536];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+    data.insert(data.end(), buffer, buffer + n);
+  fclose(f);
+  return data;
+}
+
+static bool is_elf(const char* binary)
+{
+  return binary[0] == 0x7F && binary[1] == 'E'
+      && binary[2] == 'L'  && binary[3] == 'F';
+}
+
+struct load_segment
+{
+  uint64_t paddr;
+  uint64_t offset;
+  uint64_t filesz;
+  uint64_t memsz;
+};
+
+template <typename Ehdr, typename Phdr>
+static std::vector<load_segment> read_segments(const char* binary, uint64_t& entry)
+{
+  auto* hdr = (const Ehdr*) binary;
+  entry = hdr->e_entry;
+  std::vector<load_segment> segs;
+  for (int i = 0; i < hdr->e_phnum; i++)
+  {
+    auto* phdr = (const Phdr*) &binary[hdr->e_phoff + i * hdr->e_phentsize];
+    if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0) continue;
+    segs.push_back({phdr->p_paddr, phdr->p_offset, phdr->p_filesz, phdr->p_memsz});
+  }
+  return segs;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s <service> <output>\n", argv[0]);
+    return 1;
+  }
+  auto elf = load_file(argv[1]);
+  if (elf.size() < SECT_SIZE + sizeof(Elf32_Ehdr)) {
+    fprintf(stderr, "Not an ELF binary: %s\n", argv[1]);
+    return 1;
+  }
+  // skip bootloader, if any
+  const char* binary = elf.data();
+  if (!is_elf(binary)) binary = &elf[SECT_SIZE];
+  if (!is_elf(binary)) {
+    fprintf(stderr, "Not an ELF binary: %s\n", argv[1]);
+    return 1;
+  }
+
+  uint64_t entry;
+  std::vector<load_segment> segs;
+  if (binary[EI_CLASS] == ELFCLASS32)
+    segs = read_segments<Elf32_Ehdr, Elf32_Phdr> (binary, entry);
+  else
+    segs = read_segments<Elf64_Ehdr, Elf64_Phdr> (binary, entry);
+  if (segs.empty()) {
+    fprintf(stderr, "No loadable segments in %s\n", argv[1]);
+    return 1;
+  }
+  std::sort(segs.begin(), segs.end(),
+    [] (const load_segment& a, const load_segment& b) {
+      return a.paddr < b.paddr;
+    });
+
+  // merge everything into one contiguous segment, zero-filling gaps
+  const uint64_t base = segs.front().paddr;
+  uint64_t filesz = 0, memsz = 0;
+  for (auto& seg : segs) {
+    filesz = std::max(filesz, seg.paddr - base + seg.filesz);
+    memsz  = std::max(memsz,  seg.paddr - base + seg.memsz);
+  }
+  std::vector<char> load(filesz, 0);
+  for (auto& seg : segs) {
+    if (binary + seg.offset + seg.filesz > elf.data() + elf.size()) {
+      fprintf(stderr, "Segment outside of file: %s\n", argv[1]);
+      return 1;
+    }
+    memcpy(&load[seg.paddr - base], &binary[seg.offset], seg.filesz);
+  }
+
+  liu_image_header hdr;
+  memcpy(hdr.magic, LIU_IMAGE_MAGIC, sizeof(hdr.magic));
+  hdr.entry    = entry;
+  hdr.segments = 1;
+  hdr.crc      = crc32_fast(load.data(), load.size());
+  liu_image_segment seg { base, hdr.header_length(), filesz, memsz };
+  hdr.length   = seg.offset + filesz;
+
+  FILE* out = fopen(argv[2], "wb");
+  if (out == nullptr) {
+    perror(argv[2]);
+    return 1;
+  }
+  fwrite(&hdr, 1, sizeof(hdr), out);
+  fwrite(&seg, 1, sizeof(seg), out);
+  fwrite(load.data(), 1, load.size(), out);
+  fclose(out);
+  printf("Packed %s: %zu -> %zu bytes, %zu segments, entry %#llx\n",
+        argv[2], elf.size(), (size_t) hdr.length, segs.size(),
+        (unsigned long long) entry);
+  return 0;
+}
@@ -6,9 +6,22 @@
 #include "liveupdate.hpp"
 
 #include <cstdio>
+#include <cstring>
 #include "storage.hpp"
 #include "serialize_tcp.hpp"
+#include "handoff.hpp"
+#include "blackout.hpp"
+#include "inflight.hpp"
+#include "journal.hpp"
+#include <kernel/os.hpp>
+#include <algorithm>
+#include <atomic>
+#include <exception>
 #include <map>
+#include <unordered_map>
+#ifdef INCLUDEOS_SMP_ENABLE
+#include <smp>
+#endif
 
 //#define LPRINT(x, ...) printf(x, ##__VA_ARGS__);
 #define LPRINT(x, ...) /** x **/
@@ -18,13 +31,66 @@ extern char* heap_end;
 
 namespace liu
 {
-static std::map<uint16_t, LiveUpdate::resume_func> resume_funcs;
+typedef std::map<uint16_t, LiveUpdate::resume_func> resume_map;
+static resume_map resume_funcs;
+struct section_handlers
+{
+  std::string name;
+  resume_map  funcs;
+};
+static std::unordered_map<uint32_t, section_handlers> section_funcs;
+// storage and section currently being resumed
+static storage_header* resume_storage = nullptr;
+static const resume_map* current_funcs = &resume_funcs;
+static std::map<std::string, field_converter> field_converters;
+// entries consumed by the early phase, as offsets from the storage header
+typedef std::pair<uint32_t, uint32_t> entry_range;
+struct early_state
+{
+  // where resume() is called with, and where the storage is now
+  void*                    location = nullptr;
+  storage_header*          storage  = nullptr;
+  std::vector<entry_range> consumed;
+  std::exception_ptr       error;
+  std::atomic<bool>        done {true};
+};
+// the early phase is used from global constructors in other files,
+// so its state is constructed on first use
+static std::unordered_map<uint32_t, section_handlers>& early_funcs()
+{
+  static std::unordered_map<uint32_t, section_handlers> funcs;
+  return funcs;
+}
+static early_state& early()
+{
+  static early_state state;
+  return state;
+}
+// the consumed entries for the next call to resume_begin()
+static std::vector<entry_range> skip_ranges;
 
 bool LiveUpdate::is_resumable(void* location)
 {
   return ((storage_header*) location)->validate();
 }
 
+bool LiveUpdate::seed(void* location, const void* image, size_t len)
+{
+  // data from a real live update always takes precedence
+  if (LiveUpdate::is_resumable(location)) return false;
+  if (len < sizeof(storage_header)) return false;
+
+  auto* storage = (storage_header*) location;
+  memcpy(location, image, len);
+  if (storage->total_bytes() > len || storage->validate() == false) {
+    fprintf(stderr, "WARNING: LiveUpdate seed image is invalid, ignoring it\n");
+    memset(location, 0, len);
+    return false;
+  }
+  LPRINT("* Installed seed image with %u entries\n", storage->get_entries());
+  return true;
+}
+
 static bool resume_helper(void* location, LiveUpdate::resume_func func)
 {
   // check if an update has occurred
@@ -35,8 +101,109 @@ static bool resume_helper(void* location, LiveUpdate::resume_func func)
   extern bool resume_begin(storage_header&, LiveUpdate::resume_func);
   return resume_begin(*(storage_header*) location, func);
 }
+
+typedef std::pair<uintptr_t, uintptr_t> memory_range;
+static bool overlaps(const memory_range& a, const memory_range& b) noexcept
+{
+  return a.first < b.second && b.first < a.second;
+}
+
+// memory that must still be intact after the storage has been moved:
+// the storage itself, the journals stored in it, which live on in place,
+// and on solo5 the handoff block and the rollback copy below it.
+// @storage must be validated already, since its entries are read
+static std::vector<memory_range> reserved_ranges(storage_header* storage, size_t len)
+{
+  std::vector<memory_range> ranges;
+  const uintptr_t location = (uintptr_t) storage;
+  ranges.emplace_back(location, location + len);
+#ifdef PLATFORM_x86_solo5
+  if (handoff_reserved() != nullptr) {
+    ranges.emplace_back((uintptr_t) handoff_reserved(), OS::heap_max());
+  }
+#endif
+
+  for (auto* ptr = storage->begin(); ptr->type != TYPE_END; ptr = storage->next(ptr))
+  {
+    if (ptr->type != TYPE_JOURNAL) continue;
+    auto* jent = (const journal_entry*) ptr->vla;
+    Journal journal((void*) (uintptr_t) jent->location, jent->capacity);
+    ranges.emplace_back(jent->location, jent->location + journal.extent());
+  }
+  return ranges;
+}
+
+// the highest page-aligned location below every reserved range above the
+// storage area, or nullptr if the storage cannot be moved any higher
+static char* top_of_memory(storage_header* storage, size_t len,
+                           const std::vector<memory_range>& reserved)
+{
+  const uintptr_t location = (uintptr_t) storage;
+  uintptr_t ceiling = OS::heap_max();
+  while (ceiling >= location + len)
+  {
+    const uintptr_t dest = (ceiling - len) & ~(uintptr_t) 4095;
+    if (dest < location + len) break;
+    const memory_range target {dest, dest + len};
+    auto it = std::find_if(reserved.begin(), reserved.end(),
+        [&target] (const memory_range& r) { return overlaps(r, target); });
+    if (it == reserved.end()) return (char*) dest;
+    ceiling = it->first;
+  }
+  return nullptr;
+}
+
+// move the storage to the top of memory, so that the heap can grow up to
+// it. The copy is validated in the same pass, and nothing stored, eg.
+// session keys, is left behind. Returns where the storage is now, or
+// nullptr if it overlaps reserved memory, or the copy failed validation
+static storage_header* move_to_top(storage_header* storage)
+{
+  // a little extra for legacy areas, which are checksummed past their end
+  const size_t len = storage->total_bytes() + sizeof(uint32_t);
+  if (len > OS::heap_max() - (uintptr_t) storage) return storage;
+
+  const auto reserved = reserved_ranges(storage, len);
+  // the first range is the storage itself
+  for (auto it = reserved.begin() + 1; it != reserved.end(); ++it) {
+    if (overlaps(reserved.front(), *it)) {
+      fprintf(stderr, "WARNING: LiveUpdate storage area overlaps reserved memory\n");
+      return nullptr;
+    }
+  }
+  char* dest = top_of_memory(storage, len, reserved);
+  if (dest == nullptr) return storage;
+  if (storage->relocate(dest) == false) return nullptr;
+  LPRINT("* Moved storage from %p to %p\n", storage, dest);
+  storage->zero();
+  return (storage_header*) dest;
+}
+
+// wait for the early phase to be done with @location, and hand its
+// consumed entries over to resume_begin(). Returns where the storage is
+static void* finish_early(void* location)
+{
+  auto& state = early();
+  while (state.done == false) asm volatile("pause");
+  if (state.location != location) return location;
+  state.location = nullptr;
+  skip_ranges = std::move(state.consumed);
+  state.consumed.clear();
+  if (state.error) {
+    auto error = state.error;
+    state.error = nullptr;
+    std::rethrow_exception(error);
+  }
+  return state.storage;
+}
+
 bool LiveUpdate::resume(void* location, resume_func func)
 {
+#ifdef PLATFORM_x86_solo5
+  // use the storage handed over through the tender, if any
+  if (handoff_storage() != nullptr) location = handoff_storage();
+#endif
+  location = finish_early(location);
   /// memory sanity check
   if (heap_end >= (char*) location) {
     fprintf(stderr,
@@ -44,31 +211,189 @@ bool LiveUpdate::resume(void* location, resume_func func)
 		     (long int) (heap_end - (char*) location));
     return false;
   }
+  // move the storage to the top of memory before any handler runs.
+  // Nested resumes, eg. Journal::replay() from a handler, stay where they
+  // are, since the outer storage is already at the top
+  if (resume_storage == nullptr)
+  {
+    if (LiveUpdate::is_resumable(location) == false) return false;
+    auto* storage = move_to_top((storage_header*) location);
+    if (storage == nullptr) return false;
+    location = storage;
+  }
   return resume_helper(location, func);
 }
 bool LiveUpdate::resume_from_heap(void* location, LiveUpdate::resume_func func)
 {
+  location = finish_early(location);
   return resume_helper(location, func);
 }
 
-bool resume_begin(storage_header& storage, LiveUpdate::resume_func func)
+static void enter_section(const storage_entry* ent)
+{
+  static const resume_map no_handlers;
+  auto* sect = (const section_entry*) ent->vla;
+  const size_t namelen = ent->len - sizeof(section_entry);
+  if (sect->hash == 0) {
+    current_funcs = &resume_funcs;
+    return;
+  }
+  // sections without registered handlers still have their own id space
+  current_funcs = &no_handlers;
+  auto it = section_funcs.find(sect->hash);
+  if (it != section_funcs.end() && it->second.name.size() == namelen
+   && memcmp(it->second.name.data(), sect->name, namelen) == 0)
+  {
+    current_funcs = &it->second.funcs;
+  }
+  LPRINT("* Entering section %.*s\n", (int) namelen, sect->name);
+}
+
+// the early handlers for the section starting at @ent, or nullptr
+static const resume_map* early_section(const storage_entry* ent)
+{
+  auto* sect = (const section_entry*) ent->vla;
+  const size_t namelen = ent->len - sizeof(section_entry);
+  auto it = early_funcs().find(sect->hash);
+  if (it != early_funcs().end() && it->second.name.size() == namelen
+   && memcmp(it->second.name.data(), sect->name, namelen) == 0)
+  {
+    return &it->second.funcs;
+  }
+  return nullptr;
+}
+static void early_decode(storage_header* storage)
+{
+  const resume_map* funcs = nullptr;
+  for (auto* ptr = storage->begin(); ptr->type != TYPE_END;)
+  {
+    const LiveUpdate::resume_func* handler = nullptr;
+    if (ptr->type == TYPE_SECTION) {
+      funcs = early_section(ptr);
+    }
+    else if (funcs != nullptr && ptr->type != TYPE_INDEX) {
+      auto it = funcs->find(ptr->id);
+      if (it != funcs->end()) handler = &it->second;
+    }
+    if (handler == nullptr) {
+      ptr = storage->next(ptr);
+      continue;
+    }
+    auto* oldptr = ptr;
+    Restore wrapper {ptr};
+    (*handler)(wrapper);
+    if (oldptr == ptr) ptr = storage->next(ptr);
+    // handlers can go past the end of the section with go_next()
+    for (auto* e = storage->next(oldptr); e != ptr; e = storage->next(e)) {
+      if (e->type == TYPE_SECTION) funcs = early_section(e);
+    }
+    early().consumed.emplace_back((char*) oldptr - (char*) storage,
+                                (char*) ptr - (char*) storage);
+  }
+}
+static void early_phase(void* location)
+{
+  try {
+    early_decode((storage_header*) location);
+  }
+  catch (...) {
+    // rethrown by resume()
+    early().error = std::current_exception();
+  }
+  early().done = true;
+}
+
+static void* early_boot_location = nullptr;
+static void early_boot_plugin()
+{
+  LiveUpdate::resume_early(early_boot_location);
+}
+void LiveUpdate::resume_early_at_boot(void* location)
 {
+  early_boot_location = location;
+  OS::register_plugin(early_boot_plugin, "LiveUpdate early resume");
+}
+
+void LiveUpdate::resume_early(void* location)
+{
+#ifdef PLATFORM_x86_solo5
+  if (handoff_storage() != nullptr) location = handoff_storage();
+#endif
+  auto& state = early();
+  if (early_funcs().empty() || state.done == false) return;
+  if (heap_end >= (char*) location || is_resumable(location) == false) return;
+  // out of the way of the heap, which grows while the devices are set up
+  auto* storage = move_to_top((storage_header*) location);
+  if (storage == nullptr) return;
+  LPRINT("* Starting early resume phase at %p\n", storage);
+  state.location = location;
+  state.storage  = storage;
+  state.consumed.clear();
+  state.error = nullptr;
+  state.done  = false;
+#ifdef INCLUDEOS_SMP_ENABLE
+  // decode on another core while this one initializes the devices
+  if (SMP::cpu_count() > 1) {
+    SMP::add_task([storage] { early_phase(storage); });
+    SMP::signal();
+    return;
+  }
+#endif
+  early_phase(storage);
+}
+
+bool resume_begin(storage_header& first, LiveUpdate::resume_func func)
+{
+  auto* const storage = &first;
   /// restore each entry one by one, calling registered handlers
-  auto num_ents = storage.get_entries();
+  auto num_ents = storage->get_entries();
   if (num_ents > 1) {
     LPRINT("* Resuming %d stored entries\n", num_ents-1);
   } else {
     LPRINT("* No stored entries to resume\n");
   }
 
-  for (auto* ptr = storage.begin(); ptr->type != TYPE_END;)
+  // the blackout records and packets in flight are handled internally
+  blackout_prepare();
+  inflight_prepare();
+
+  // entries already decoded by the early phase, see resume_early()
+  std::vector<entry_range> skips;
+  if (resume_storage == nullptr) skips.swap(skip_ranges);
+  auto skip = skips.begin();
+
+  // resume can be nested, eg. when replaying a journal from a handler
+  auto* outer_storage = resume_storage;
+  auto* outer_funcs   = current_funcs;
+  resume_storage = storage;
+  current_funcs  = &resume_funcs;
+
+  for (auto* ptr = storage->begin(); ptr->type != TYPE_END;)
   {
+    const uint32_t offset = (char*) ptr - (char*) storage;
+    while (skip != skips.end() && skip->second <= offset) ++skip;
+    if (skip != skips.end() && skip->first <= offset)
+    {
+      // keep track of the sections the early handlers went past
+      auto* end = (storage_entry*) ((char*) storage + skip->second);
+      for (; ptr != end; ptr = storage->next(ptr)) {
+        if (ptr->type == TYPE_SECTION) enter_section(ptr);
+      }
+      continue;
+    }
+    // section boundaries and the section index are not user entries
+    if (ptr->type == TYPE_SECTION || ptr->type == TYPE_INDEX)
+    {
+      if (ptr->type == TYPE_SECTION) enter_section(ptr);
+      ptr = storage->next(ptr);
+      continue;
+    }
     auto* oldptr = ptr;
     // resume wrapper
     Restore wrapper {ptr};
     // use registered functions when we can, otherwise, use normal
-    auto it = resume_funcs.find(ptr->id);
-    if (it != resume_funcs.end())
+    auto it = current_funcs->find(ptr->id);
+    if (it != current_funcs->end())
     {
       it->second(wrapper);
     } else {
@@ -77,12 +402,23 @@ bool resume_begin(storage_header& storage, LiveUpdate::resume_func func)
     // if we are already at the end due calls to go_next, break early
     if (ptr->type == TYPE_END) break;
     // call next manually only when no one called go_next
-    if (oldptr == ptr) ptr = storage.next(ptr);
+    if (oldptr == ptr) ptr = storage->next(ptr);
+    // handlers can go past the end of the section with go_next()
+    else for (auto* e = storage->next(oldptr); e != ptr; e = storage->next(e)) {
+      if (e->type == TYPE_SECTION) enter_section(e);
+    }
   }
+  resume_storage = outer_storage;
+  current_funcs  = outer_funcs;
   /// wake all the slumbering IP stacks
   serialized_tcp::wakeup_ip_networks();
+  /// and hand them the packets that were in flight during the update
+  inflight_reinject();
+  /// then start timing their first segments, once the outermost resume
+  /// has restored every connection
+  if (outer_storage == nullptr) blackout_resumed();
   /// zero out all the state for security reasons
-  storage.zero();
+  storage->zero();
 
   return true;
 }
@@ -91,6 +427,41 @@ void LiveUpdate::on_resume(uint16_t id, resume_func func)
 {
   resume_funcs[id] = func;
 }
+void LiveUpdate::on_resume(const std::string& section, uint16_t id, resume_func func)
+{
+  if (section.empty()) {
+    resume_funcs[id] = func;
+    return;
+  }
+  auto& handlers = section_funcs[section_hash(section.data(), section.size())];
+  if (handlers.name.empty()) {
+    handlers.name = section;
+  }
+  else if (handlers.name != section) {
+    throw std::runtime_error("Section name collides with " + handlers.name);
+  }
+  handlers.funcs[id] = func;
+}
+void LiveUpdate::on_resume_early(const std::string& section, uint16_t id,
+                                 resume_func func)
+{
+  // the global section can have anything in it, eg. connections
+  if (section.empty())
+      throw std::runtime_error("Early resume handlers need a named section");
+  auto& handlers = early_funcs()[section_hash(section.data(), section.size())];
+  if (handlers.name.empty()) {
+    handlers.name = section;
+  }
+  else if (handlers.name != section) {
+    throw std::runtime_error("Section name collides with " + handlers.name);
+  }
+  handlers.funcs[id] = func;
+}
+void LiveUpdate::on_convert(const std::string& type, const std::string& field,
+                            field_converter func)
+{
+  field_converters[type + "::" + field] = func;
+}
 
 /// struct Restore
 
@@ -106,6 +477,10 @@ bool Restore::is_marker() const noexcept
 {
   return get_type() == TYPE_MARKER;
 }
+bool Restore::is_struct() const noexcept
+{
+  return get_type() == TYPE_STRUCT;
+}
 
 int Restore::as_int() const
 {
@@ -131,7 +506,9 @@ buffer_t  Restore::as_buffer() const
 }
 Restore::Connection_ptr Restore::as_tcp_connection(net::TCP& tcp) const
 {
-  return deserialize_connection(ent->vla, tcp);
+  auto conn = deserialize_connection(ent->vla, tcp);
+  blackout_restored(conn);
+  return conn;
 }
 
 int16_t     Restore::get_type() const noexcept
@@ -181,6 +558,55 @@ std::vector<std::string> Restore::rebuild_string_vector() const
   }
   return retv;
 }
+void Restore::rebuild_struct(void* dest, size_t size,
+                             const char* type, const layout_t& layout) const
+{
+  // stored in the legacy format, without a layout
+  if (ent->type == TYPE_BUFFER && (size_t) ent->len == size) {
+    memcpy(dest, ent->vla, size);
+    return;
+  }
+  if (ent->type != TYPE_STRUCT)
+      throw std::runtime_error("Incorrect type: " + std::to_string(ent->type));
+
+  auto* lent = (const layout_entry*) ent->vla;
+  const auto* stored = lent->layout();
+  // fast path: the layout has not changed since the update
+  if (lent->size == size && lent->fields == layout.size()
+   && memcmp(stored, layout.data(), layout.size() * sizeof(layout_field)) == 0)
+  {
+    memcpy(dest, lent->data(), size);
+    return;
+  }
+  LPRINT("* Converting %s from %u to %u bytes\n", type, lent->size, (uint32_t) size);
+
+  for (const auto& field : layout)
+  {
+    const layout_field* from = nullptr;
+    for (int i = 0; i < lent->fields; i++) {
+      if (strncmp(stored[i].name, field.name, layout_field::NAME_LEN) == 0) {
+        from = &stored[i]; break;
+      }
+    }
+    char*       dst = (char*) dest + field.offset;
+    const char* src = (from) ? lent->data() + from->offset : nullptr;
+    if (src && from->offset + from->size > lent->size)
+        throw std::runtime_error("Stored field outside struct: " + std::string(field.name));
+
+    auto it = field_converters.find(std::string(type) + "::" + field.name);
+    if (it != field_converters.end())
+    {
+      // the converter is also called for new fields, with a null source
+      static const layout_field missing {};
+      it->second(dst, field, src, (from) ? *from : missing);
+    }
+    else if (from != nullptr) {
+      if (convert_field(dst, field, src, *from) == false)
+          throw std::runtime_error("Cannot convert field " + std::string(type) + "::" + field.name);
+    }
+    // new fields keep their initial value
+  }
+}
 
 ///
 void     Restore::go_next()
@@ -188,11 +614,28 @@ void     Restore::go_next()
   if (is_end())
       throw std::runtime_error("Already reached end of storage");
   // increase the counter, so the resume loop skips entries properly
-  ent = ent->next();
+  // section boundaries and the section index are not user entries
+  do {
+    ent = ent->next();
+  } while (ent->type == TYPE_SECTION || ent->type == TYPE_INDEX);
 }
 uint16_t Restore::next_id() const noexcept
 {
-  return ent->next()->id;
+  auto* next = ent->next();
+  while (next->type == TYPE_SECTION || next->type == TYPE_INDEX)
+      next = next->next();
+  return next->id;
+}
+bool Restore::section(const std::string& name)
+{
+  if (resume_storage == nullptr) return false;
+  auto* sect = resume_storage->find_section(name);
+  // entries before this one have already been resumed
+  if (sect == nullptr || sect <= ent) return false;
+  // the resume loop enters the section when it sees how far we went
+  ent = sect;
+  go_next();
+  return true;
 }
 
 uint16_t Restore::pop_marker()
@@ -1,6 +1,11 @@
 #! /bin/bash
 set -e
 IMAGE=$1
+# optional raw disk holding an update image
+DISK=
+if [ -n "$2" ]; then
+  DISK="-drive file=$2,format=raw,if=virtio"
+fi
 
 $INCLUDEOS_PREFIX/includeos/scripts/create_bridge.sh
-sudo qemu-system-x86_64 --enable-kvm --cpu host -kernel $IMAGE -m 24 -nographic -netdev  tap,id=net0,script=$INCLUDEOS_PREFIX/includeos/scripts/qemu-ifup -device virtio-net,netdev=net0,mac=c0:01:0a:00:00:2a
+sudo qemu-system-x86_64 --enable-kvm --cpu host -kernel $IMAGE -m 24 -nographic -netdev  tap,id=net0,script=$INCLUDEOS_PREFIX/includeos/scripts/qemu-ifup -device virtio-net,netdev=net0,mac=c0:01:0a:00:00:2a $DISK
@@ -0,0 +1,135 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+ * Host-side tool that builds a seed storage image from data files.
+ * The image uses the same entry format as LiveUpdate::begin(), so a fresh
+ * instance can go through the ordinary resume() path and start warm.
+ *
+ * Usage: seed <output> <id>:<type>:<file> ...
+ *   type is one of: buffer, string, lines
+ *
+**/
+#include "storage.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct seed_file
+{
+  uint16_t    id;
+  std::string type;
+  std::vector<char> data;
+};
+
+static std::vector<char> load_file(const char* path)
+{
+  FILE* f = fopen(path, "rb");
+  if (f == nullptr) {
+    perror(path);
+    exit(1);
+  }
+  std::vector<char> data;
+  char buffer[65536];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+    data.insert(data.end(), buffer, buffer + n);
+  fclose(f);
+  return data;
+}
+
+static std::vector<std::string> split_lines(const std::vector<char>& data)
+{
+  std::vector<std::string> lines;
+  size_t begin = 0;
+  for (size_t i = 0; i < data.size(); i++)
+  {
+    if (data[i] == '\n') {
+      lines.emplace_back(&data[begin], i - begin);
+      begin = i + 1;
+    }
+  }
+  if (begin < data.size())
+      lines.emplace_back(&data[begin], data.size() - begin);
+  return lines;
+}
+
+static seed_file parse_arg(const char* arg)
+{
+  const char* c1 = strchr(arg, ':');
+  const char* c2 = (c1) ? strchr(c1 + 1, ':') : nullptr;
+  if (c2 == nullptr) {
+    fprintf(stderr, "Invalid entry '%s', expected <id>:<type>:<file>\n", arg);
+    exit(1);
+  }
+  seed_file sf;
+  sf.id   = (uint16_t) strtoul(arg, nullptr, 0);
+  sf.type = std::string(c1 + 1, c2 - c1 - 1);
+  sf.data = load_file(c2 + 1);
+  return sf;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s <output> <id>:<type>:<file> ...\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<seed_file> files;
+  // storage header, END entry and some room for per-entry headers
+  size_t capacity = sizeof(storage_header) + sizeof(storage_entry);
+  for (int i = 2; i < argc; i++)
+  {
+    files.push_back(parse_arg(argv[i]));
+    auto& sf = files.back();
+    capacity += sizeof(storage_entry) + sizeof(varseg_begin) + sf.data.size();
+    // each line of a string vector has its own header
+    if (sf.type == "lines")
+        capacity += split_lines(sf.data).size() * sizeof(varseg_entry);
+  }
+
+  std::vector<char> image(capacity);
+  auto* storage = new (image.data()) storage_header();
+
+  for (auto& sf : files)
+  {
+    if (sf.type == "buffer") {
+      storage->add_buffer(sf.id, sf.data.data(), sf.data.size());
+    }
+    else if (sf.type == "string") {
+      storage->add_string(sf.id, std::string(sf.data.begin(), sf.data.end()));
+    }
+    else if (sf.type == "lines") {
+      storage->add_string_vector(sf.id, split_lines(sf.data));
+    }
+    else {
+      fprintf(stderr, "Unknown entry type: %s\n", sf.type.c_str());
+      return 1;
+    }
+    printf("* Added id=%u type=%s (%zu bytes)\n",
+          sf.id, sf.type.c_str(), sf.data.size());
+  }
+  if (const char* failure = storage->finalize()) {
+    fprintf(stderr, "Seed image failed: %s\n", failure);
+    return 1;
+  }
+  if (storage->validate() == false) {
+    fprintf(stderr, "Seed image failed validation\n");
+    return 1;
+  }
+
+  FILE* out = fopen(argv[1], "wb");
+  if (out == nullptr) {
+    perror(argv[1]);
+    return 1;
+  }
+  fwrite(image.data(), 1, storage->total_bytes(), out);
+  fclose(out);
+  printf("Seed image %s: %u entries, %zu bytes\n",
+        argv[1], storage->get_entries(), storage->total_bytes());
+  return 0;
+}
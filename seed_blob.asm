@@ -0,0 +1,10 @@
+global liu_seed_image
+global liu_seed_image_len
+
+SECTION .rodata
+ALIGN 16
+liu_seed_image:
+    incbin "seed.img"
+
+liu_seed_image_len:
+    dd $ - liu_seed_image
@@ -0,0 +1,62 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#include "block_cache.hpp"
+#include "liveupdate.hpp"
+#include "storage.hpp"
+#include <cstring>
+
+namespace liu
+{
+void Storage::add_block_cache(uid id, size_t block_size,
+                              const cached_block* blocks, size_t count)
+{
+  size_t contents = 0;
+  for (size_t i = 0; i < count; i++)
+    if (blocks[i].data) contents++;
+
+  auto& entry = hdr.add_struct(TYPE_BLOCK_CACHE, id,
+                    sizeof(block_cache_entry) + count * sizeof(uint64_t)
+                    + contents * block_size);
+  auto* bent = (block_cache_entry*) entry.vla;
+  bent->block_size = block_size;
+  bent->count      = count;
+
+  char* data = bent->data();
+  for (size_t i = 0; i < count; i++)
+  {
+    if (blocks[i].data) {
+      bent->blocks[i] = blocks[i].block;
+      memcpy(data, blocks[i].data, block_size);
+      data += block_size;
+    }
+    else {
+      bent->blocks[i] = blocks[i].block | block_cache_entry::REFERENCE;
+    }
+  }
+}
+
+size_t Restore::as_block_cache(block_func adopt) const
+{
+  if (ent->type != TYPE_BLOCK_CACHE)
+      throw std::runtime_error("Incorrect type: " + std::to_string(ent->type));
+  auto* bent = (const block_cache_entry*) ent->vla;
+
+  const char* data = bent->data();
+  for (size_t i = 0; i < bent->count; i++)
+  {
+    const uint64_t block = bent->blocks[i];
+    if (block & block_cache_entry::REFERENCE) {
+      adopt(block & ~block_cache_entry::REFERENCE, nullptr, bent->block_size);
+    }
+    else {
+      adopt(block, data, bent->block_size);
+      data += bent->block_size;
+    }
+  }
+  return bent->count;
+}
+
+} // liu
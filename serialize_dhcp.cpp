@@ -0,0 +1,119 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#include "lease.hpp"
+#include "liveupdate.hpp"
+#include "storage.hpp"
+#include <kernel/os.hpp>
+#include <timers>
+#include <cstring>
+
+namespace liu
+{
+// the time from the store to the swap is not on either clock, so leases
+// this close to expiring are not trusted after an update
+static const int64_t LEASE_MARGIN = 1000000;
+// how long the fallback DHCP request waits, in seconds
+static const double  DHCP_TIMEOUT = 10.0;
+
+struct stored_dns
+{
+  net::ip4::Addr addr;
+  int64_t        remaining;
+  uint32_t       namelen;
+  char           name[0];
+};
+
+void Storage::add_lease(uid id, const dhcp_lease& lease)
+{
+  auto& entry = hdr.add_struct(TYPE_DHCP_LEASE, id, sizeof(dhcp_lease));
+  auto* stored = (dhcp_lease*) entry.vla;
+  *stored = lease;
+  const int64_t now = OS::micros_since_boot();
+  stored->renew   -= now;
+  stored->expires -= now;
+}
+
+void Storage::add_dns_cache(uid id, const std::vector<dns_record>& cache)
+{
+  const int64_t now = OS::micros_since_boot();
+  hdr.add_struct(TYPE_DNS_CACHE, id,
+  [&cache, now] (char* dest) -> int
+  {
+    auto* head = (varseg_begin*) dest;
+    head->count = cache.size();
+    int total_len = sizeof(varseg_begin);
+
+    auto* rec = (stored_dns*) head->vla;
+    for (auto& record : cache)
+    {
+      rec->addr      = record.addr;
+      rec->remaining = record.expires - now;
+      rec->namelen   = record.name.size();
+      memcpy(rec->name, record.name.data(), rec->namelen);
+      total_len += sizeof(stored_dns) + rec->namelen;
+      // next
+      rec = (stored_dns*) &rec->name[rec->namelen];
+    }
+    return total_len;
+  });
+}
+
+dhcp_lease Restore::as_lease() const
+{
+  if (ent->type != TYPE_DHCP_LEASE)
+      throw std::runtime_error("Incorrect type: " + std::to_string(ent->type));
+  dhcp_lease lease = *(const dhcp_lease*) ent->vla;
+  const int64_t now = OS::micros_since_boot();
+  lease.renew   += now;
+  lease.expires += now;
+  return lease;
+}
+
+std::vector<dns_record> Restore::as_dns_cache() const
+{
+  if (ent->type != TYPE_DNS_CACHE)
+      throw std::runtime_error("Incorrect type: " + std::to_string(ent->type));
+  auto* head = (const varseg_begin*) ent->vla;
+  std::vector<dns_record> cache;
+  cache.reserve(head->count);
+
+  const int64_t now = OS::micros_since_boot();
+  auto* rec = (const stored_dns*) head->vla;
+  for (size_t i = 0; i < head->count; i++)
+  {
+    // expired records are simply dropped
+    if (rec->remaining > 0) {
+      cache.push_back({std::string(rec->name, rec->namelen),
+                       rec->addr, now + rec->remaining});
+    }
+    rec = (const stored_dns*) &rec->name[rec->namelen];
+  }
+  return cache;
+}
+
+bool apply_lease(net::Inet<net::IP4>& inet, const dhcp_lease& lease,
+                 delegate<void()> on_renew)
+{
+  const int64_t now = OS::micros_since_boot();
+  // the lease ran out during the update, so the address is not ours
+  if (lease.expires - LEASE_MARGIN <= now) {
+    inet.negotiate_dhcp(DHCP_TIMEOUT);
+    return false;
+  }
+  inet.network_config(lease.address, lease.netmask, lease.gateway, lease.dns);
+
+  if (lease.renew <= now) {
+    on_renew();
+    return true;
+  }
+  Timers::oneshot(std::chrono::microseconds(lease.renew - now),
+    [on_renew] (int) {
+      on_renew();
+    });
+  return true;
+}
+
+} // liu
@@ -0,0 +1,68 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#include "flows.hpp"
+#include "liveupdate.hpp"
+#include "storage.hpp"
+#include <kernel/os.hpp>
+#include <cstring>
+
+namespace liu
+{
+// copy a table into storage, replacing expiry times with remaining time
+template <typename Entry>
+static void store_table(storage_header& hdr, int16_t type, uint16_t id,
+                        const Entry* table, size_t count)
+{
+  auto& entry = hdr.add_struct(type, id,
+                    sizeof(segmented_entry) + count * sizeof(Entry));
+  auto& segs = entry.get_segs();
+  segs.count = count;
+  segs.esize = sizeof(Entry);
+  memcpy(segs.vla, table, count * sizeof(Entry));
+
+  const int64_t now = OS::micros_since_boot();
+  auto* stored = (Entry*) segs.vla;
+  for (size_t i = 0; i < count; i++)
+    stored[i].expires -= now;
+}
+
+template <typename Entry>
+static std::vector<Entry> restore_table(storage_entry* ent, int16_t type)
+{
+  if (ent->type != type)
+      throw std::runtime_error("Incorrect type: " + std::to_string(ent->type));
+  auto& segs = ent->get_segs();
+  if (segs.esize != sizeof(Entry))
+      throw std::runtime_error("Incorrect type size: " + std::to_string(segs.esize));
+
+  auto* first = (const Entry*) segs.vla;
+  std::vector<Entry> table(first, first + segs.count);
+  // rebase the remaining time on the new clock
+  const int64_t now = OS::micros_since_boot();
+  for (auto& entry : table)
+    entry.expires += now;
+  return table;
+}
+
+void Storage::add_flows(uid id, const flow_entry* table, size_t count)
+{
+  store_table(hdr, TYPE_CONNTRACK, id, table, count);
+}
+void Storage::add_nat(uid id, const nat_entry* table, size_t count)
+{
+  store_table(hdr, TYPE_NAT, id, table, count);
+}
+
+std::vector<flow_entry> Restore::as_flows() const
+{
+  return restore_table<flow_entry> (ent, TYPE_CONNTRACK);
+}
+std::vector<nat_entry> Restore::as_nat() const
+{
+  return restore_table<nat_entry> (ent, TYPE_NAT);
+}
+
+} // liu
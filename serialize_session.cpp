@@ -0,0 +1,91 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#include "liveupdate.hpp"
+#include "storage.hpp"
+#include "serialize_tcp.hpp"
+#include "blackout.hpp"
+#include <cstring>
+
+namespace liu
+{
+void Storage::add_session(uid id, const std::vector<Connection_ptr>& conns,
+                          const void* meta, size_t meta_len)
+{
+  add_session(id, conns.data(), conns.size(), meta, meta_len);
+}
+void Storage::add_session(uid id, const Connection_ptr* conns, size_t count,
+                          const void* meta, size_t meta_len)
+{
+  hdr.add_struct(TYPE_SESSION, id,
+  [&] (char* location) -> int {
+    auto* sent = (session_entry*) location;
+    sent->count    = count;
+    sent->meta_len = meta_len;
+    memcpy(sent->vla, meta, meta_len);
+    int len = align8(meta_len);
+    // each connection is prefixed by its length
+    for (size_t i = 0; i < count; i++)
+    {
+      auto& conn = conns[i];
+      auto* clen = (uint64_t*) &sent->vla[len];
+      len += sizeof(uint64_t);
+      const int state_len = conn->serialize_to(&sent->vla[len]);
+      blackout_frozen(*conn, state_len);
+      *clen = align8(state_len);
+      len += *clen;
+    }
+    return sizeof(session_entry) + len;
+  });
+}
+
+static void restore_session(storage_entry* ent, net::TCP& tcp,
+                            std::vector<Restore::Connection_ptr>& conns,
+                            session_func func)
+{
+  auto* sent = (session_entry*) ent->vla;
+  conns.clear();
+  int len = align8(sent->meta_len);
+  for (uint32_t i = 0; i < sent->count; i++)
+  {
+    const auto clen = *(uint64_t*) &sent->vla[len];
+    len += sizeof(uint64_t);
+    conns.push_back(deserialize_connection(&sent->vla[len], tcp));
+    blackout_restored(conns.back());
+    len += clen;
+  }
+  func(conns, sent->vla, sent->meta_len);
+}
+
+void Restore::as_session(net::TCP& tcp, session_func func) const
+{
+  if (ent->type != TYPE_SESSION)
+      throw std::runtime_error("Incorrect type: " + std::to_string(ent->type));
+  std::vector<Connection_ptr> conns;
+  restore_session(ent, tcp, conns, func);
+}
+
+size_t Restore::as_sessions(net::TCP& tcp, session_func func)
+{
+  if (ent->type != TYPE_SESSION)
+      throw std::runtime_error("Incorrect type: " + std::to_string(ent->type));
+  const uint16_t id = ent->id;
+  size_t count = 0;
+  // reuse one vector for every session
+  std::vector<Connection_ptr> conns;
+  for (;;)
+  {
+    restore_session(ent, tcp, conns, func);
+    count++;
+    // the run ends at a section boundary, which go_next() steps over
+    auto* next = ent->next();
+    if (next->type != TYPE_SESSION || next->id != id) break;
+    ent = next;
+  }
+  go_next();
+  return count;
+}
+
+} // liu
@@ -53,3 +53,11 @@ struct serialized_tcp
 };
 
 extern std::shared_ptr<::net::tcp::Connection> deserialize_connection(void* addr, net::TCP& tcp);
+
+namespace liu
+{
+// serialized connections are padded, so that whatever follows is aligned
+inline int align8(int len) noexcept {
+  return (len + 7) & ~7;
+}
+}
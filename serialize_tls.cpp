@@ -0,0 +1,87 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#include "tls.hpp"
+#include "liveupdate.hpp"
+#include "storage.hpp"
+#include "serialize_tcp.hpp"
+#include "blackout.hpp"
+#include <kernel/os.hpp>
+#include <cstring>
+
+namespace liu
+{
+void Storage::add_tls_connection(uid id, Connection_ptr conn, const tls_state& state,
+                                 const buffer_t& pending_in, const buffer_t& pending_out)
+{
+  auto& entry = hdr.add_struct(TYPE_TLS, id,
+  [&] (char* location) -> int {
+    auto* tent = (tls_entry*) location;
+    tent->state = state;
+    // the TCP connection, followed by the buffered records
+    int len = align8(conn->serialize_to(tent->vla));
+    tent->tcp_len = len;
+    tent->in_len  = pending_in.size();
+    memcpy(&tent->vla[len], pending_in.data(), pending_in.size());
+    len += tent->in_len;
+    tent->out_len = pending_out.size();
+    memcpy(&tent->vla[len], pending_out.data(), pending_out.size());
+    len += tent->out_len;
+    return sizeof(tls_entry) + len;
+  });
+  blackout_frozen(*conn, entry.len);
+}
+
+Restore::Connection_ptr
+Restore::as_tls_connection(net::TCP& tcp, tls_state& state,
+                           buffer_t& pending_in, buffer_t& pending_out) const
+{
+  if (ent->type != TYPE_TLS)
+      throw std::runtime_error("Incorrect type: " + std::to_string(ent->type));
+  auto* tent = (tls_entry*) ent->vla;
+  state = tent->state;
+
+  const char* in  = &tent->vla[tent->tcp_len];
+  const char* out = in + tent->in_len;
+  pending_in.assign(in, in + tent->in_len);
+  pending_out.assign(out, out + tent->out_len);
+  auto conn = deserialize_connection(tent->vla, tcp);
+  blackout_restored(conn);
+  return conn;
+}
+
+void Storage::add_ticket_keys(uid id, const std::vector<ticket_key>& keys)
+{
+  auto& entry = hdr.add_struct(TYPE_TLS_KEYS, id,
+                    sizeof(segmented_entry) + keys.size() * sizeof(ticket_key));
+  auto& segs = entry.get_segs();
+  segs.count = keys.size();
+  segs.esize = sizeof(ticket_key);
+  memcpy(segs.vla, keys.data(), keys.size() * sizeof(ticket_key));
+
+  const int64_t now = OS::micros_since_boot();
+  auto* stored = (ticket_key*) segs.vla;
+  for (size_t i = 0; i < keys.size(); i++)
+    stored[i].expires -= now;
+}
+
+std::vector<ticket_key> Restore::as_ticket_keys() const
+{
+  if (ent->type != TYPE_TLS_KEYS)
+      throw std::runtime_error("Incorrect type: " + std::to_string(ent->type));
+  auto& segs = ent->get_segs();
+  if (segs.esize != sizeof(ticket_key))
+      throw std::runtime_error("Incorrect type size: " + std::to_string(segs.esize));
+
+  auto* first = (const ticket_key*) segs.vla;
+  std::vector<ticket_key> keys(first, first + segs.count);
+  // rebase the remaining time on the new clock
+  const int64_t now = OS::micros_since_boot();
+  for (auto& key : keys)
+    key.expires += now;
+  return keys;
+}
+
+} // liu
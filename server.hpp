@@ -5,11 +5,12 @@
 **/
 #pragma once
 #include <stdexcept>
+#include "signature.hpp"
 
 static inline
 void server(net::Inet<net::IP4>& inet,
             const uint16_t port,
-            delegate<void(liu::buffer_t&)> callback)
+            delegate<void(liu::buffer_t&, const liu::verified_image&)> callback)
 {
   auto& server = inet.tcp().listen(port);
   server.on_connect(
@@ -19,19 +20,33 @@ void server(net::Inet<net::IP4>& inet,
     auto* buffer = new liu::buffer_t;
     buffer->reserve(3*1024*1024);
     printf("Receiving blob on port %u\n", port);
+    // verify signed images while they are streaming in
+    liu::Image_verifier* verifier = nullptr;
+    if (liu::LiveUpdate::has_verification_key())
+        verifier = new liu::Image_verifier;
 
     // retrieve binary
     conn->on_read(9000,
-    [conn, buffer] (net::tcp::buffer_t buf, size_t n)
+    [conn, buffer, verifier] (net::tcp::buffer_t buf, size_t n)
     {
       buffer->insert(buffer->end(), buf.get(), buf.get() + n);
+      if (verifier) verifier->update(buf.get(), n);
     })
     .on_disconnect(
     net::tcp::Connection::DisconnectCallback::make_packed(
-    [buffer, callback] (auto conn, auto) {
+    [buffer, verifier, callback] (auto conn, auto) {
       printf("* Blob size: %u b  stored at %p\n",
             (uint32_t) buffer->size(), buffer->data());
-      callback(*buffer);
+      if (verifier == nullptr) {
+        callback(*buffer, liu::verified_image());
+      }
+      else if (verifier->finish()) {
+        // begin() does not have to hash the image again
+        callback(*buffer, verifier->result(*buffer));
+      } else {
+        printf("* Blob signature verification failed\n");
+      }
+      delete verifier;
       delete buffer;
       conn->close();
     }));
@@ -15,12 +15,14 @@ void setup_liveupdate_server(net::Inet<net::IP4>&, storage_func_t);
 extern storage_func_t begin_test_all(net::Inet<net::IP4>&);
 extern storage_func_t begin_test_boot();
 extern storage_func_t begin_test_tcpflow(net::Inet<net::IP4>&);
+extern storage_func_t begin_test_bench();
 
 void Service::start()
 {
   printf("\n");
   printf("-= Starting LiveUpdate test service =-\n");
   auto func = begin_test_boot();
+  //auto func = begin_test_bench();
 
   if (liu::LiveUpdate::is_resumable(LIVEUPD_LOCATION) == false)
   {
@@ -43,14 +45,14 @@ void setup_liveupdate_server(net::Inet<net::IP4>& inet, liu::LiveUpdate::storage
 
   // listen for live updates
   server(inet, 666,
-  [] (liu::buffer_t& buffer)
+  [] (liu::buffer_t& buffer, const liu::verified_image& verified)
   {
     printf("* Live updating from %p (len=%u)\n",
             buffer.data(), (uint32_t) buffer.size());
     try
     {
       // run live update process
-      liu::LiveUpdate::begin(LIVEUPD_LOCATION, buffer, save_function);
+      liu::LiveUpdate::begin(LIVEUPD_LOCATION, std::move(buffer), verified, save_function);
     }
     catch (std::exception& err)
     {
@@ -62,7 +64,7 @@ void setup_liveupdate_server(net::Inet<net::IP4>& inet, liu::LiveUpdate::storage
   });
   // listen for rollback blobs
   server(inet, 665,
-  [] (liu::buffer_t& buffer)
+  [] (liu::buffer_t& buffer, const liu::verified_image&)
   {
     static liu::buffer_t rb_blob;
     rb_blob = buffer;
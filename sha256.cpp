@@ -0,0 +1,270 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#include "sha256.hpp"
+#include <algorithm>
+#include <cstring>
+#include <cpuid.h>
+#include <immintrin.h>
+
+namespace liu
+{
+static const uint32_t K[64] __attribute__((aligned(16))) = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+// the 64 rounds over a complete message schedule
+static inline void sha256_rounds(uint32_t state[8], const uint32_t W[64])
+{
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+  for (int i = 0; i < 64; i++)
+  {
+    const uint32_t S1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+    const uint32_t ch = (e & f) ^ (~e & g);
+    const uint32_t t1 = h + S1 + ch + K[i] + W[i];
+    const uint32_t S0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+    const uint32_t mj = (a & b) ^ (a & c) ^ (b & c);
+    const uint32_t t2 = S0 + mj;
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+  state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+static void blocks_portable(uint32_t state[8], const uint8_t* data, size_t blocks)
+{
+  while (blocks--)
+  {
+    uint32_t W[64];
+    for (int i = 0; i < 16; i++)
+      W[i] = (data[i*4] << 24) | (data[i*4+1] << 16) | (data[i*4+2] << 8) | data[i*4+3];
+    for (int i = 16; i < 64; i++) {
+      const uint32_t s0 = rotr(W[i-15], 7) ^ rotr(W[i-15], 18) ^ (W[i-15] >> 3);
+      const uint32_t s1 = rotr(W[i-2], 17) ^ rotr(W[i-2], 19)  ^ (W[i-2] >> 10);
+      W[i] = W[i-16] + s0 + W[i-7] + s1;
+    }
+    sha256_rounds(state, W);
+    data += SHA256::BLOCK_LEN;
+  }
+}
+
+#define ROR256(x, n) \
+  _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - (n)))
+
+// the message schedules of two blocks are expanded side by side, one in
+// each 128-bit lane, and the rounds use BMI2 rotates
+__attribute__((target("avx2,bmi2")))
+static void blocks_avx2(uint32_t state[8], const uint8_t* data, size_t blocks)
+{
+  const __m256i BSWAP = _mm256_set_epi8(
+      12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3,
+      12,13,14,15, 8,9,10,11, 4,5,6,7, 0,1,2,3);
+  const __m256i zero = _mm256_setzero_si256();
+  uint32_t W[2][64] __attribute__((aligned(32)));
+
+  for (; blocks >= 2; blocks -= 2)
+  {
+    __m256i x[16];
+    for (int i = 0; i < 4; i++)
+    {
+      const __m128i lo = _mm_loadu_si128((const __m128i*) &data[i*16]);
+      const __m128i hi = _mm_loadu_si128((const __m128i*) &data[SHA256::BLOCK_LEN + i*16]);
+      x[i] = _mm256_shuffle_epi8(
+          _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), BSWAP);
+    }
+    // W[i..i+3] from W[i-16..i-1], where the last two words need the
+    // first two, so sigma1 is added one half at a time
+    for (int i = 4; i < 16; i++)
+    {
+      const __m256i w15 = _mm256_alignr_epi8(x[i-3], x[i-4], 4);
+      const __m256i w7  = _mm256_alignr_epi8(x[i-1], x[i-2], 4);
+      const __m256i s0  = _mm256_xor_si256(_mm256_xor_si256(
+          ROR256(w15, 7), ROR256(w15, 18)), _mm256_srli_epi32(w15, 3));
+      __m256i t = _mm256_add_epi32(_mm256_add_epi32(x[i-4], s0), w7);
+
+      __m256i w2 = _mm256_shuffle_epi32(x[i-1], 0xEE);
+      __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(
+          ROR256(w2, 17), ROR256(w2, 19)), _mm256_srli_epi32(w2, 10));
+      t  = _mm256_add_epi32(t, _mm256_blend_epi32(zero, s1, 0x33));
+      w2 = _mm256_shuffle_epi32(t, 0x44);
+      s1 = _mm256_xor_si256(_mm256_xor_si256(
+          ROR256(w2, 17), ROR256(w2, 19)), _mm256_srli_epi32(w2, 10));
+      x[i] = _mm256_add_epi32(t, _mm256_blend_epi32(zero, s1, 0xCC));
+    }
+    for (int i = 0; i < 16; i++) {
+      _mm_store_si128((__m128i*) &W[0][i*4], _mm256_castsi256_si128(x[i]));
+      _mm_store_si128((__m128i*) &W[1][i*4], _mm256_extracti128_si256(x[i], 1));
+    }
+    sha256_rounds(state, W[0]);
+    sha256_rounds(state, W[1]);
+    data += 2 * SHA256::BLOCK_LEN;
+  }
+  if (blocks) blocks_portable(state, data, 1);
+}
+#undef ROR256
+
+__attribute__((target("sha,sse4.1")))
+static void blocks_shani(uint32_t state[8], const uint8_t* data, size_t blocks)
+{
+  const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bull, 0x0405060700010203ull);
+  // state is kept as ABEF and CDGH
+  __m128i tmp    = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[0]), 0xB1);
+  __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*) &state[4]), 0x1B);
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+  while (blocks--)
+  {
+    const __m128i abef = state0;
+    const __m128i cdgh = state1;
+    __m128i msg[16];
+    for (int i = 0; i < 16; i++)
+    {
+      if (i < 4) {
+        msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*) &data[i*16]), MASK);
+      } else {
+        tmp = _mm_sha256msg1_epu32(msg[i-4], msg[i-3]);
+        tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(msg[i-1], msg[i-2], 4));
+        msg[i] = _mm_sha256msg2_epu32(tmp, msg[i-1]);
+      }
+      __m128i wk = _mm_add_epi32(msg[i], _mm_load_si128((const __m128i*) &K[i*4]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+      wk     = _mm_shuffle_epi32(wk, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+    data += SHA256::BLOCK_LEN;
+  }
+  // back to ABCD and EFGH
+  tmp    = _mm_shuffle_epi32(state0, 0x1B);
+  state1 = _mm_shuffle_epi32(state1, 0xB1);
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+  state1 = _mm_alignr_epi8(state1, tmp, 8);
+  _mm_storeu_si128((__m128i*) &state[0], state0);
+  _mm_storeu_si128((__m128i*) &state[4], state1);
+}
+
+typedef void (*blocks_func)(uint32_t*, const uint8_t*, size_t);
+
+static blocks_func select_blocks() noexcept
+{
+  unsigned eax, ebx, ecx, edx;
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0) return blocks_portable;
+  const bool sse41 = ecx & bit_SSE4_1;
+  // AVX state has to be enabled in XCR0 as well
+  bool ymm = false;
+  if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX)) {
+    uint32_t xcr0, xcr0_hi;
+    asm volatile("xgetbv" : "=a"(xcr0), "=d"(xcr0_hi) : "c"(0));
+    ymm = (xcr0 & 0x6) == 0x6;
+  }
+  if (__get_cpuid_max(0, nullptr) < 7) return blocks_portable;
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  const bool sha  = ebx & (1u << 29);
+  const bool avx2 = ymm && (ebx & (1u << 5)) && (ebx & (1u << 8));
+  if (sha && sse41) return blocks_shani;
+  return (avx2) ? blocks_avx2 : blocks_portable;
+}
+static blocks_func sha256_blocks() noexcept
+{
+  static const blocks_func func = select_blocks();
+  return func;
+}
+
+bool SHA256::accelerated() noexcept
+{
+  return sha256_blocks() != blocks_portable;
+}
+
+SHA256::SHA256() noexcept
+  : state { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 } {}
+
+void SHA256::update(const void* vdata, size_t len) noexcept
+{
+  auto* data = (const uint8_t*) vdata;
+  total += len;
+  // complete a partial block first
+  if (buffered > 0)
+  {
+    const size_t n = std::min(len, (size_t) BLOCK_LEN - buffered);
+    memcpy(&buffer[buffered], data, n);
+    buffered += n; data += n; len -= n;
+    if (buffered < BLOCK_LEN) return;
+    sha256_blocks()(state, buffer, 1);
+    buffered = 0;
+  }
+  // whole blocks straight from the input
+  if (len >= BLOCK_LEN) {
+    sha256_blocks()(state, data, len / BLOCK_LEN);
+    data += len & ~(size_t) (BLOCK_LEN-1);
+    len  &= BLOCK_LEN-1;
+  }
+  memcpy(buffer, data, len);
+  buffered = len;
+}
+
+void SHA256::finish(uint8_t digest[DIGEST_LEN]) noexcept
+{
+  const uint64_t bits = total * 8;
+  const uint8_t pad = 0x80;
+  update(&pad, 1);
+  static const uint8_t zeroes[BLOCK_LEN] = {};
+  update(zeroes, (BLOCK_LEN + 56 - buffered) % BLOCK_LEN);
+  uint8_t length[8];
+  for (int i = 0; i < 8; i++) length[i] = bits >> (56 - i*8);
+  update(length, sizeof(length));
+
+  for (int i = 0; i < 8; i++) {
+    digest[i*4+0] = state[i] >> 24;
+    digest[i*4+1] = state[i] >> 16;
+    digest[i*4+2] = state[i] >> 8;
+    digest[i*4+3] = state[i];
+  }
+}
+
+HMAC_SHA256::HMAC_SHA256(const void* key, size_t keylen) noexcept
+{
+  uint8_t kblock[SHA256::BLOCK_LEN] = {};
+  if (keylen > SHA256::BLOCK_LEN) {
+    SHA256 hash;
+    hash.update(key, keylen);
+    hash.finish(kblock);
+  }
+  else memcpy(kblock, key, keylen);
+
+  uint8_t ipad[SHA256::BLOCK_LEN];
+  for (int i = 0; i < SHA256::BLOCK_LEN; i++) {
+    ipad[i] = kblock[i] ^ 0x36;
+    opad[i] = kblock[i] ^ 0x5c;
+  }
+  inner.update(ipad, sizeof(ipad));
+}
+
+void HMAC_SHA256::finish(uint8_t mac[SHA256::DIGEST_LEN]) noexcept
+{
+  uint8_t digest[SHA256::DIGEST_LEN];
+  inner.finish(digest);
+  SHA256 outer;
+  outer.update(opad, sizeof(opad));
+  outer.update(digest, sizeof(digest));
+  outer.finish(mac);
+}
+
+} // liu
@@ -0,0 +1,54 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#pragma once
+#ifndef LIVEUPDATE_SHA256_HPP
+#define LIVEUPDATE_SHA256_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+namespace liu
+{
+/**
+ * Streaming SHA-256 and HMAC-SHA256, used to verify update images.
+ * The block function is selected at runtime, and uses the x86 SHA
+ * extensions when the CPU has them, or else AVX2 and BMI2.
+**/
+struct SHA256
+{
+  static const int DIGEST_LEN = 32;
+  static const int BLOCK_LEN  = 64;
+
+  SHA256() noexcept;
+  void update(const void*, size_t) noexcept;
+  void finish(uint8_t digest[DIGEST_LEN]) noexcept;
+
+  // true when the SHA extensions or AVX2 are used
+  static bool accelerated() noexcept;
+
+private:
+  uint32_t state[8];
+  uint64_t total = 0;
+  uint8_t  buffer[BLOCK_LEN];
+  size_t   buffered = 0;
+};
+
+struct HMAC_SHA256
+{
+  HMAC_SHA256(const void* key, size_t keylen) noexcept;
+  void update(const void* data, size_t len) noexcept {
+    inner.update(data, len);
+  }
+  void finish(uint8_t mac[SHA256::DIGEST_LEN]) noexcept;
+
+private:
+  SHA256  inner;
+  uint8_t opad[SHA256::BLOCK_LEN];
+};
+
+} // liu
+
+#endif
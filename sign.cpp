@@ -0,0 +1,64 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+ * Host-side tool that appends an HMAC-SHA256 authentication trailer to
+ * an update image, see signature.hpp.
+ *
+ * Usage: sign <keyfile> <image> <output>
+ *
+**/
+#include "sha256.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+static const char SIGNATURE_MAGIC[8] = {'L','I','U','S','I','G','0','1'};
+
+static std::vector<char> load_file(const char* path)
+{
+  FILE* f = fopen(path, "rb");
+  if (f == nullptr) {
+    perror(path);
+    exit(1);
+  }
+  std::vector<char> data;
+  char buffer[65536];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+    data.insert(data.end(), buffer, buffer + n);
+  fclose(f);
+  return data;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 4) {
+    fprintf(stderr, "Usage: %s <keyfile> <image> <output>\n", argv[0]);
+    return 1;
+  }
+  auto key   = load_file(argv[1]);
+  auto image = load_file(argv[2]);
+  if (key.empty()) {
+    fprintf(stderr, "Empty key file: %s\n", argv[1]);
+    return 1;
+  }
+
+  liu::HMAC_SHA256 hmac(key.data(), key.size());
+  hmac.update(image.data(), image.size());
+  uint8_t mac[liu::SHA256::DIGEST_LEN];
+  hmac.finish(mac);
+
+  FILE* out = fopen(argv[3], "wb");
+  if (out == nullptr) {
+    perror(argv[3]);
+    return 1;
+  }
+  fwrite(image.data(), 1, image.size(), out);
+  fwrite(mac, 1, sizeof(mac), out);
+  fwrite(SIGNATURE_MAGIC, 1, sizeof(SIGNATURE_MAGIC), out);
+  fclose(out);
+  printf("Signed %s (%zu bytes, SHA extensions: %s)\n",
+        argv[3], image.size(), liu::SHA256::accelerated() ? "yes" : "no");
+  return 0;
+}
@@ -0,0 +1,107 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#include "signature.hpp"
+#include "liveupdate.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace liu
+{
+static std::vector<uint8_t> verification_key;
+
+void LiveUpdate::set_verification_key(const void* key, size_t len)
+{
+  auto* bytes = (const uint8_t*) key;
+  verification_key.assign(bytes, bytes + len);
+}
+bool LiveUpdate::has_verification_key() noexcept
+{
+  return verification_key.empty() == false;
+}
+
+static bool signature_matches(const uint8_t* trailer, const uint8_t* mac) noexcept
+{
+  if (memcmp(&trailer[SIGNATURE_LEN], SIGNATURE_MAGIC, sizeof(SIGNATURE_MAGIC)))
+      return false;
+  // constant time compare
+  uint8_t diff = 0;
+  for (size_t i = 0; i < SIGNATURE_LEN; i++) diff |= trailer[i] ^ mac[i];
+  return diff == 0;
+}
+
+bool LiveUpdate::verify_image(const buffer_t& blob)
+{
+  if (has_verification_key() == false)
+      throw std::runtime_error("No LiveUpdate verification key set");
+  if (blob.size() <= TRAILER_LEN) return false;
+
+  const size_t len = blob.size() - TRAILER_LEN;
+  auto* trailer = (const uint8_t*) &blob[len];
+
+  HMAC_SHA256 hmac(verification_key.data(), verification_key.size());
+  hmac.update(blob.data(), len);
+  uint8_t mac[SIGNATURE_LEN];
+  hmac.finish(mac);
+  return signature_matches(trailer, mac);
+}
+
+Image_verifier::Image_verifier()
+  : hmac(verification_key.data(), verification_key.size())
+{
+  if (LiveUpdate::has_verification_key() == false)
+      throw std::runtime_error("No LiveUpdate verification key set");
+}
+
+void Image_verifier::update(const void* vdata, size_t len) noexcept
+{
+  auto* data = (const uint8_t*) vdata;
+  if (tail_len + len <= TRAILER_LEN) {
+    memcpy(&tail[tail_len], data, len);
+    tail_len += len;
+    return;
+  }
+  // everything except the last TRAILER_LEN bytes is part of the image
+  const size_t feed = tail_len + len - TRAILER_LEN;
+  const size_t from_tail = std::min(feed, tail_len);
+  hmac.update(tail, from_tail);
+  hmac.update(data, feed - from_tail);
+  // keep the rest of the old tail, followed by the end of the data
+  const size_t keep = tail_len - from_tail;
+  memmove(tail, &tail[from_tail], keep);
+  memcpy(&tail[keep], &data[len - (TRAILER_LEN - keep)], TRAILER_LEN - keep);
+  tail_len = TRAILER_LEN;
+}
+
+bool Image_verifier::finish() noexcept
+{
+  if (tail_len != TRAILER_LEN) return false;
+  uint8_t mac[SIGNATURE_LEN];
+  hmac.finish(mac);
+  verified = signature_matches(tail, mac);
+  return verified;
+}
+
+verified_image Image_verifier::result(const buffer_t& image) const noexcept
+{
+  verified_image token;
+  if (verified == false || image.size() <= TRAILER_LEN) return token;
+  token.data = image.data();
+  token.size = image.size();
+  memcpy(token.mac, tail, SIGNATURE_LEN);
+  return token;
+}
+
+bool verified_image::matches(const buffer_t& blob) const noexcept
+{
+  if (data == nullptr || blob.data() != data || blob.size() != size)
+      return false;
+  // the trailer is still the one that was verified
+  auto* trailer = (const uint8_t*) &blob[size - TRAILER_LEN];
+  return signature_matches(trailer, mac);
+}
+
+} // liu
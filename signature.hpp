@@ -0,0 +1,70 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#pragma once
+#ifndef LIVEUPDATE_SIGNATURE_HPP
+#define LIVEUPDATE_SIGNATURE_HPP
+
+#include "sha256.hpp"
+#include <vector>
+
+namespace liu
+{
+typedef std::vector<char> buffer_t;
+/**
+ * Image authentication: update images carry a trailer after the image
+ * itself, with an HMAC-SHA256 of the image made with the shared key
+ * configured with LiveUpdate::set_verification_key(), followed by
+ * SIGNATURE_MAGIC. Images are authenticated on the host with sign.cpp.
+ *
+ * This is not a public-key signature. Every node holding the key can also
+ * authenticate images, so the key has to be kept as secret as a signing
+ * key would be.
+ *
+ * The Image_verifier checks the trailer while the image is streaming in,
+ * eg. from the TCP upload, so that bad images are rejected before they are
+ * handed to begin(). Its result is tied to the buffer the image was
+ * streamed into, and begin() only hashes the image again when it is given
+ * another buffer, or the trailer in it has changed.
+**/
+static const char   SIGNATURE_MAGIC[8] = {'L','I','U','S','I','G','0','1'};
+static const size_t SIGNATURE_LEN = SHA256::DIGEST_LEN;
+static const size_t TRAILER_LEN   = SIGNATURE_LEN + sizeof(SIGNATURE_MAGIC);
+
+// the result of verifying an image while it was streaming in
+struct verified_image
+{
+  const char* data = nullptr;
+  size_t      size = 0;
+  uint8_t     mac[SIGNATURE_LEN] {};
+
+  // true if @blob is the buffer that was verified
+  bool matches(const buffer_t& blob) const noexcept;
+};
+
+struct Image_verifier
+{
+  // throws if there is no verification key
+  Image_verifier();
+
+  // feed the next part of the signed image
+  void update(const void*, size_t) noexcept;
+  // returns true if the image was signed with the verification key
+  bool finish() noexcept;
+  // the result of finish() for the buffer the image was streamed into,
+  // which is empty unless finish() returned true
+  verified_image result(const buffer_t& image) const noexcept;
+
+private:
+  HMAC_SHA256 hmac;
+  // the trailer is held back, since it is not part of the image
+  uint8_t     tail[TRAILER_LEN];
+  size_t      tail_len = 0;
+  bool        verified = false;
+};
+
+} // liu
+
+#endif
@@ -0,0 +1,180 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#include "snapshot.hpp"
+#include "storage.hpp"
+#include <timers>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+//#define LPRINT(x, ...) printf(x, ##__VA_ARGS__);
+#define LPRINT(x, ...) /** x **/
+
+// how often the parent checks if the child has finished
+static const std::chrono::milliseconds SNAPSHOT_POLL {1};
+// inaccessible memory after the area, where a store that does not fit
+// faults in the child, instead of writing past the mapping
+static const size_t SNAPSHOT_GUARD = 1 << 20;
+
+namespace liu
+{
+static int create_backing(const std::string& path, size_t capacity)
+{
+  int fd;
+  // the descriptor is inherited across exec on purpose
+  if (path.empty())
+      fd = syscall(SYS_memfd_create, "liveupdate", 0);
+  else
+      fd = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+  if (fd < 0)
+      throw std::runtime_error("Could not create snapshot backing: " + std::string(strerror(errno)));
+  if (ftruncate(fd, capacity) < 0) {
+    close(fd);
+    throw std::runtime_error("Could not resize snapshot backing: " + std::string(strerror(errno)));
+  }
+  return fd;
+}
+
+Snapshot::Snapshot(size_t capacity, const std::string& path)
+  : cap(capacity), file(create_backing(path, capacity))
+{
+  void* range = mmap(nullptr, cap + SNAPSHOT_GUARD, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (range == MAP_FAILED) {
+    close(file);
+    throw std::runtime_error("Could not reserve snapshot area");
+  }
+  area = mmap(range, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, file, 0);
+  if (area == MAP_FAILED) {
+    munmap(range, cap + SNAPSHOT_GUARD);
+    close(file);
+    throw std::runtime_error("Could not map snapshot area");
+  }
+  // invalidate any old snapshot
+  memset(area, 0, sizeof(storage_header));
+}
+Snapshot::~Snapshot()
+{
+  if (timer >= 0) Timers::stop(timer);
+  if (child > 0) {
+    kill(child, SIGKILL);
+    waitpid(child, nullptr, 0);
+  }
+  munmap(area, cap + SNAPSHOT_GUARD);
+  close(file);
+}
+
+void Snapshot::take(LiveUpdate::storage_func func, done_func done,
+                    LiveUpdate::error_func error)
+{
+  if (is_busy())
+      throw std::runtime_error("Snapshot is already in progress");
+  // failures happen from the event loop, where nothing can catch them
+  if (error == nullptr)
+      throw std::runtime_error("Snapshot::take() needs an error handler");
+  this->ready    = false;
+  this->stored   = 0;
+  this->on_done  = done;
+  this->on_error = error;
+  // invalidate the previous snapshot before the child starts writing
+  memset(area, 0, sizeof(storage_header));
+
+  child = fork();
+  if (child < 0) {
+    child = -1;
+    fail("Could not fork snapshot process");
+    return;
+  }
+  if (child == 0)
+  {
+    // the child sees a copy-on-write image of the parent, frozen in time
+    int status = 0;
+    try {
+      // anything past the capacity faults in the guard
+      if (LiveUpdate::store(area, func) > cap) status = 1;
+    }
+    catch (const std::exception& e) {
+      fprintf(stderr, "Snapshot failed: %s\n", e.what());
+      status = 1;
+    }
+    // skip atexit handlers and destructors that belong to the parent
+    _exit(status);
+  }
+  LPRINT("* Snapshot started in process %d\n", child);
+  timer = Timers::periodic(SNAPSHOT_POLL, SNAPSHOT_POLL,
+    [this] (int) { this->poll(); });
+}
+
+void Snapshot::poll()
+{
+  int status;
+  const pid_t pid = waitpid(child, &status, WNOHANG);
+  if (pid == 0) return;
+
+  Timers::stop(timer);
+  timer = -1;
+  child = -1;
+  if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fail("Snapshot process failed");
+    return;
+  }
+  // the length is checked before validation reads that far
+  auto* storage = (storage_header*) area;
+  if (storage->has_magic() == false || storage->total_bytes() > cap) {
+    fail("Snapshot does not fit its area");
+    return;
+  }
+  if (LiveUpdate::is_resumable(area) == false) {
+    fail("Snapshot failed validation");
+    return;
+  }
+  stored = storage->total_bytes();
+  ready  = true;
+  LPRINT("* Snapshot completed with %zu bytes\n", stored);
+  if (on_done) on_done(*this);
+}
+
+void Snapshot::fail(const char* reason)
+{
+  on_error(std::runtime_error(reason));
+}
+
+void Storage::add_snapshot(uid id, Snapshot& snapshot)
+{
+  if (snapshot.is_ready() == false)
+      throw std::runtime_error("Snapshot is not ready");
+  auto& entry = hdr.add_struct(TYPE_SNAPSHOT, id, sizeof(snapshot_entry));
+  auto* sent = (snapshot_entry*) entry.vla;
+  sent->fd     = snapshot.fd();
+  sent->length = snapshot.length();
+}
+
+void* Restore::as_snapshot() const
+{
+  if (ent->type != TYPE_SNAPSHOT)
+      throw std::runtime_error("Incorrect type: " + std::to_string(ent->type));
+  auto* sent = (const snapshot_entry*) ent->vla;
+  struct stat st;
+  if (fstat(sent->fd, &st) < 0 || sent->length > (uint64_t) st.st_size)
+      throw std::runtime_error("Snapshot is larger than its backing");
+  // the storage format is position-independent, so map it anywhere
+  void* area = mmap(nullptr, sent->length, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, sent->fd, 0);
+  if (area == MAP_FAILED)
+      throw std::runtime_error("Could not map snapshot area");
+  return area;
+}
+
+} // liu
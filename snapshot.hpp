@@ -0,0 +1,79 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#pragma once
+#ifndef LIVEUPDATE_SNAPSHOT_HPP
+#define LIVEUPDATE_SNAPSHOT_HPP
+
+#include "liveupdate.hpp"
+#include <sys/types.h>
+
+namespace liu
+{
+/**
+ * Copy-on-write snapshots for hosted builds (LIVEUPDATE_HOSTED).
+ *
+ * take() forks the service, and the child stores a consistent image of
+ * the state into a shared area with the given storage function, while the
+ * parent keeps serving. The parent polls for the child from the event loop
+ * and calls the completion handler when the snapshot is ready.
+ *
+ * At the final handover, Storage::add_snapshot() only records where the
+ * snapshot is, so that begin() just has to store the state that changes
+ * all the time, eg. TCP connections. The area is backed by a file or a
+ * memfd that is kept open across exec, and after the update
+ * Restore::as_snapshot() maps it again so that it can be resumed with
+ * LiveUpdate::resume().
+ *
+ * A snapshot that does not fit in the capacity fails, since the area is
+ * followed by an inaccessible guard that stops the child. How much this
+ * shortens the blackout of an update has not been measured.
+ *
+**/
+struct Snapshot
+{
+  typedef delegate<void(Snapshot&)> done_func;
+
+  // create a shared area with room for @capacity bytes, backed by the
+  // file at @path, or by an anonymous memfd if @path is empty
+  Snapshot(size_t capacity, const std::string& path = "");
+  ~Snapshot();
+  Snapshot(const Snapshot&) = delete;
+  Snapshot& operator= (const Snapshot&) = delete;
+
+  // fork and store the state in the child process, calling @on_done in
+  // the parent when it has finished. Failures are reported to @on_error
+  // from the event loop, so it is required
+  void take(LiveUpdate::storage_func, done_func on_done,
+            LiveUpdate::error_func on_error);
+
+  // true while a child is storing a snapshot
+  bool   is_busy()  const noexcept { return child > 0; }
+  // true if the last snapshot completed and passed validation
+  bool   is_ready() const noexcept { return ready; }
+
+  void*  location() const noexcept { return area; }
+  size_t capacity() const noexcept { return cap; }
+  size_t length()   const noexcept { return stored; }
+  int    fd()       const noexcept { return file; }
+
+private:
+  void poll();
+  void fail(const char* reason);
+
+  void*  area;
+  size_t cap;
+  int    file;
+  size_t stored = 0;
+  bool   ready  = false;
+  pid_t  child  = -1;
+  int    timer  = -1;
+  done_func              on_done;
+  LiveUpdate::error_func on_error;
+};
+
+} // liu
+
+#endif
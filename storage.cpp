@@ -5,17 +5,54 @@
 **/
 #include "storage.hpp"
 
+#ifndef LIU_HOST_TOOL
 #include <kernel/os.hpp>
+#endif
 #include <util/crc32.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
 #include <cassert>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
 //#define VERIFY_MEMORY
 
-const uint64_t storage_header::LIVEUPD_MAGIC = 0xbaadb33fdeadc0de;
+const uint64_t storage_header::LEGACY_MAGIC  = 0xbaadb33fdeadc0de;
+const uint64_t storage_header::LIVEUPD_MAGIC = 0xbaadb33fdeadc0df;
 
-storage_header::storage_header()
+storage_header::storage_header(uint16_t ver)
   : magic(LIVEUPD_MAGIC), crc(0), entries(0), length(0)
 {
-  //printf("%p --> %#llx\n", this, value);
+  if (ver == VERSION_LEGACY) {
+    // the entries start where the version would have been
+    this->magic = LEGACY_MAGIC;
+    return;
+  }
+  if (ver != VERSION_CURRENT)
+      throw std::runtime_error("Unsupported storage format: " + std::to_string(ver));
+  this->version    = ver;
+  this->header_len = sizeof(storage_header);
+  this->required   = 0;
+  this->optional   = 0;
+  this->index      = 0;
+  this->reserved   = 0;
+}
+
+static const char* failure_reason(uint32_t reason) noexcept
+{
+  switch (reason) {
+  case STORE_NEEDS_SECTIONS:
+      return "Sections need storage format version 2";
+  case STORE_NEEDS_VERSION2:
+      return "Entry type is not supported by storage format version 1";
+  case STORE_OUTSIDE_MEMORY:
+      return "LiveUpdate storage end outside memory";
+  case STORE_NOT_WRITABLE:
+      return "Failed to write canary to end of storage";
+  }
+  return "Unknown LiveUpdate storage failure";
 }
 
 inline uint32_t liu_crc32(const void* buf, size_t len)
@@ -27,18 +64,34 @@ void storage_header::add_marker(uint16_t id)
 {
   create_entry(TYPE_MARKER, id, 0);
 }
+void storage_header::add_section(const char* name, size_t len)
+{
+  if (is_legacy()) {
+    // everything is in the global section in the legacy format
+    if (len != 0) fail(STORE_NEEDS_SECTIONS);
+    return;
+  }
+  auto& entry = create_entry(TYPE_SECTION, 0, sizeof(section_entry) + len);
+  auto* sect = (section_entry*) entry.vla;
+  sect->hash = section_hash(name, len);
+  memcpy(sect->name, name, len);
+  if (sect->hash != 0) {
+    this->required |= FEATURE_SECTIONS;
+    this->index++;
+  }
+}
 void storage_header::add_int(uint16_t id, int value)
 {
   create_entry(TYPE_INTEGER, id, value);
 }
-void storage_header::add_string(uint16_t id, const std::string& data)
+void storage_header::add_string(uint16_t id, const char* data, size_t len)
 {
-  auto& entry = create_entry(TYPE_STRING, id, data.size());
+  auto& entry = create_entry(TYPE_STRING, id, len);
   /// copy string (but not the zero)
-  memcpy(entry.vla, data.c_str(), data.size());
+  memcpy(entry.vla, data, len);
 #ifdef VERIFY_MEMORY
   /// verify memory
-  uint32_t csum = liu_crc32(data.c_str(), data.size());
+  uint32_t csum = liu_crc32(data, len);
   assert(entry.checksum() == csum);
 #endif
 }
@@ -91,41 +144,134 @@ void storage_header::add_string_vector(uint16_t id, const std::vector<std::strin
     return total_len;
   });
 }
-void storage_header::add_end()
+void storage_header::add_layout(uint16_t id, const char* type,
+                                const liu::layout_t& layout,
+                                const void* data, int size)
+{
+  // the plain struct, as the legacy Storage::add() wrote it
+  if (is_legacy()) {
+    add_buffer(id, (const char*) data, size);
+    return;
+  }
+  const int layout_len = layout.size() * sizeof(liu::layout_field);
+  auto& entry = create_entry(TYPE_STRUCT, id,
+                    sizeof(layout_entry) + layout_len + size);
+  auto* lent = (layout_entry*) entry.vla;
+  memset(lent->type, 0, sizeof(lent->type));
+  strncpy(lent->type, type, sizeof(lent->type)-1);
+  lent->size     = size;
+  lent->fields   = layout.size();
+  lent->reserved = 0;
+  memcpy(lent->vla, layout.data(), layout_len);
+  memcpy(&lent->vla[layout_len], data, size);
+}
+void storage_header::add_end() noexcept
 {
   auto& ent = create_entry(TYPE_END);
 
+#ifndef LIU_HOST_TOOL
   // test against heap max
   uintptr_t storage_end = (uintptr_t) ent.vla;
-  if (storage_end > OS::heap_max())
-  {
-    printf("ERROR:\n"
-          "Storage end outside memory: %#lx > %#lx by %ld bytes\n",
-	        storage_end,
-	        OS::heap_max()+1,
-          storage_end - (OS::heap_max()+1));
-    throw std::runtime_error("LiveUpdate storage end outside memory");
+  if (storage_end > OS::heap_max()) {
+    fail(STORE_OUTSIDE_MEMORY);
+    return;
   }
+#endif
   // verify memory is writable at the current end
   static const int END_CANARY = 0xbeefc4f3;
   *((volatile int*) &ent.len) = END_CANARY;
-  if (ent.len != END_CANARY)
-      throw std::runtime_error("Failed to write canary to end of storage");
+  if (ent.len != END_CANARY) {
+    fail(STORE_NOT_WRITABLE);
+    return;
+  }
   // restore length to zero
   ent.len = 0;
 }
 
-void storage_header::finalize()
+const char* storage_header::finalize() noexcept
 {
-  if (this->magic != LIVEUPD_MAGIC)
-      throw std::runtime_error("Magic field invalidated during store process");
+  if (this->magic != LIVEUPD_MAGIC && this->magic != LEGACY_MAGIC)
+      return "Magic field invalidated during store process";
+  add_index();
   add_end();
+  if (this->crc != STORE_OK) return failure_reason(this->crc);
   this->crc = generate_checksum();
+  return nullptr;
 }
-bool storage_header::validate() noexcept
+
+void storage_header::add_index()
+{
+  if (is_legacy()) return;
+  const uint32_t sections = this->index;
+  this->index = 0;
+  if (sections == 0) return;
+
+  const uint32_t capacity = index_capacity(sections);
+
+  auto& entry = create_entry(TYPE_INDEX, 0,
+                  sizeof(section_index) + capacity * sizeof(section_index::slot));
+  auto* table = (section_index*) entry.vla;
+  auto* vla   = data();
+  table->capacity = capacity;
+  memset(table->slots, 0, capacity * sizeof(section_index::slot));
+
+  for (auto* ent = begin(); ent != &entry; ent = ent->next())
+  {
+    if (ent->type != TYPE_SECTION) continue;
+    auto* sect = (section_entry*) ent->vla;
+    if (sect->hash == 0) continue;
+    // linear probing, the first section with a given name wins
+    for (uint32_t i = sect->hash;; i++)
+    {
+      auto& slot = table->slots[i & (capacity-1)];
+      if (slot.offset == 0) {
+        slot.hash   = sect->hash;
+        slot.offset = (char*) ent - vla + 1;
+        break;
+      }
+      auto* other = (storage_entry*) &vla[slot.offset - 1];
+      if (slot.hash == sect->hash && other->len == ent->len
+       && memcmp(other->vla, ent->vla, ent->len) == 0) break;
+    }
+  }
+  this->index = (char*) &entry - vla;
+  this->optional |= FEATURE_INDEX;
+}
+
+storage_entry* storage_header::find_section(const std::string& name) noexcept
 {
-  if (this->magic != LIVEUPD_MAGIC) return false;
+  if (is_legacy() || this->index == 0) return nullptr;
+  auto* vla = data();
+  const uint32_t hash = section_hash(name.data(), name.size());
+  auto* table = (section_index*) ((storage_entry*) &vla[index])->vla;
+
+  for (uint32_t i = hash;; i++)
+  {
+    auto& slot = table->slots[i & (table->capacity-1)];
+    if (slot.offset == 0) return nullptr;
+    if (slot.hash != hash) continue;
+    auto* ent  = (storage_entry*) &vla[slot.offset - 1];
+    auto* sect = (section_entry*) ent->vla;
+    if (ent->len == (int) (sizeof(section_entry) + name.size())
+     && memcmp(sect->name, name.data(), name.size()) == 0) return ent;
+  }
+}
+bool storage_header::validate_header() const noexcept
+{
+  if (has_magic() == false) return false;
   if (this->crc   == 0) return false;
+  if (is_legacy() == false)
+  {
+    if (this->version < VERSION_CURRENT) return false;
+    if (this->header_len < sizeof(storage_header)) return false;
+    // written with features this reader does not understand
+    if (this->required & ~SUPPORTED_FEATURES) return false;
+  }
+  return true;
+}
+bool storage_header::validate() noexcept
+{
+  if (validate_header() == false) return false;
 
   uint32_t chsum = generate_checksum();
   if (this->crc != chsum) return false;
@@ -138,22 +284,83 @@ uint32_t storage_header::generate_checksum() noexcept
   this->crc         = 0;
 
   const char* begin = (const char*) this;
-  size_t      len   = sizeof(storage_header) + this->length;
+  size_t      len   = checksum_length();
   uint32_t checksum = liu_crc32(begin, len);
 
   this->crc = crc_copy;
   return checksum;
 }
 
+#ifdef __SSE4_2__
+// copy @len bytes while calculating their CRC-32C, continuing from @hash
+static uint32_t copy_crc32c(uint32_t hash, char* dst, const char* src, size_t len) noexcept
+{
+  uint64_t hash64 = hash;
+  for (; len >= 8; len -= 8, src += 8, dst += 8)
+  {
+    uint64_t word;
+    memcpy(&word, src, 8);
+    hash64 = _mm_crc32_u64(hash64, word);
+    memcpy(dst, &word, 8);
+  }
+  hash = hash64;
+  for (; len > 0; len--)
+  {
+    hash = _mm_crc32_u8(hash, *src);
+    *dst++ = *src++;
+  }
+  return hash;
+}
+// true if crc32_fast is the CRC-32C that copy_crc32c calculates
+static bool copy_crc32c_matches() noexcept
+{
+  static const char test[] = "liveupdate relocation self-test";
+  static const bool matches = [] {
+    char copy[sizeof(test)];
+    uint32_t hash = copy_crc32c(0xFFFFFFFF, copy, test, sizeof(test));
+    return (hash ^ 0xFFFFFFFF) == liu_crc32(test, sizeof(test));
+  }();
+  return matches;
+}
+#endif
+
+bool storage_header::relocate(void* dest) noexcept
+{
+  if (has_magic() == false) return false;
+  // legacy areas are checksummed a little past their end
+  const size_t crc_len = checksum_length();
+  const size_t len = std::max(crc_len, total_bytes());
+  char* dst = (char*) dest;
+#ifdef __SSE4_2__
+  if (copy_crc32c_matches())
+  {
+    // the checksum is calculated with the crc field zeroed
+    const uint32_t crc_value = this->crc;
+    static const size_t CRC_END = offsetof(storage_header, crc) + sizeof(crc);
+    char head[CRC_END];
+    memcpy(head, this, CRC_END);
+    memset(&head[offsetof(storage_header, crc)], 0, sizeof(crc));
+    uint32_t hash = copy_crc32c(0xFFFFFFFF, dst, head, CRC_END);
+    hash = copy_crc32c(hash, &dst[CRC_END], (const char*) this + CRC_END, crc_len - CRC_END);
+    memcpy(&dst[crc_len], (const char*) this + crc_len, len - crc_len);
+    memcpy(&dst[offsetof(storage_header, crc)], &crc_value, sizeof(crc));
+    return crc_value != 0 && (hash ^ 0xFFFFFFFF) == crc_value
+        && ((storage_header*) dest)->validate_header();
+  }
+#endif
+  memcpy(dst, this, len);
+  return ((storage_header*) dest)->validate();
+}
+
 void storage_header::zero()
 {
-  memset(this, 0, sizeof(storage_header) + this->length);
+  memset(this, 0, total_bytes());
   assert(this->magic == 0);
 }
 
 storage_entry* storage_header::begin()
 {
-  return (storage_entry*) vla;
+  return (storage_entry*) data();
 }
 storage_entry* storage_header::next(storage_entry* ptr)
 {
@@ -8,19 +8,37 @@
 #include <string>
 #include <vector>
 #include <delegate>
+#include "layout.hpp"
+#include "tls.hpp"
 
 enum storage_type
 {
   TYPE_END     = 0,
   TYPE_MARKER  = 1,
   TYPE_INTEGER = 2,
+  TYPE_SECTION = 3,
+  TYPE_INDEX   = 4,
 
   TYPE_STRING  = 10,
   TYPE_BUFFER  = 11,
   TYPE_VECTOR  = 12,
   TYPE_STR_VECTOR = 13,
+  TYPE_STRUCT  = 14,
+  TYPE_ARENA   = 15,
+  TYPE_JOURNAL = 16,
+  TYPE_CONNTRACK = 17,
+  TYPE_NAT     = 18,
+  TYPE_DHCP_LEASE = 19,
+  TYPE_DNS_CACHE  = 20,
+  TYPE_SNAPSHOT   = 21,
+  TYPE_BLOCK_CACHE = 22,
+  TYPE_TLS_KEYS   = 23,
+  TYPE_TELEMETRY  = 24,
+  TYPE_INFLIGHT   = 25,
 
   TYPE_TCP = 100,
+  TYPE_TLS = 101,
+  TYPE_SESSION = 102,
 };
 
 struct segmented_entry
@@ -41,6 +59,134 @@ struct varseg_entry
   char   vla[0];
 };
 
+// FNV-1a, where 0 is reserved for the global (unnamed) section
+inline uint32_t section_hash(const char* name, size_t len) noexcept
+{
+  if (len == 0) return 0;
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t) name[i];
+    hash *= 16777619u;
+  }
+  return (hash != 0) ? hash : 1;
+}
+
+struct section_entry
+{
+  uint32_t   hash;
+  char       name[0];
+};
+
+struct section_index
+{
+  struct slot {
+    uint32_t hash;
+    uint32_t offset; // offset of section entry + 1, or 0 if empty
+  };
+  uint32_t   capacity;
+  slot       slots[0];
+};
+
+struct arena_entry
+{
+  uint64_t   length;
+  char       vla[0];
+};
+
+struct journal_entry
+{
+  uint64_t   location;
+  uint64_t   capacity;
+};
+
+struct snapshot_entry
+{
+  int64_t    fd;
+  uint64_t   length;
+};
+
+struct block_cache_entry
+{
+  static const uint64_t REFERENCE = 1ull << 63;
+  uint32_t   block_size;
+  uint32_t   count;
+  // block numbers, followed by the contents of non-references
+  uint64_t   blocks[0];
+
+  char* data() noexcept {
+    return (char*) &blocks[count];
+  }
+  const char* data() const noexcept {
+    return (const char*) &blocks[count];
+  }
+};
+
+struct tls_entry
+{
+  liu::tls_state state;
+  uint32_t   tcp_len;
+  uint32_t   in_len;
+  uint32_t   out_len;
+  uint32_t   reserved;
+  // TCP connection, then buffered incoming and outgoing records
+  char       vla[0];
+};
+
+struct session_entry
+{
+  uint32_t   count;
+  uint32_t   meta_len;
+  // metadata, then each connection prefixed by its length
+  char       vla[0];
+};
+
+struct telemetry_entry
+{
+  uint64_t   seq;
+  int64_t    ts;
+  uint32_t   epoch;
+  uint32_t   count;
+  // unsent samples
+  char       vla[0];
+};
+
+struct inflight_packet
+{
+  uint8_t    direction;
+  uint8_t    ifindex;
+  uint16_t   len;
+  char       data[0];
+
+  // packets are 4-byte aligned one after the other
+  size_t size() const noexcept {
+    return (sizeof(inflight_packet) + len + 3) & ~(size_t) 3;
+  }
+};
+struct inflight_entry
+{
+  uint32_t   count;
+  // packets that did not fit within the capture limit
+  uint32_t   dropped;
+  char       vla[0];
+};
+
+struct layout_entry
+{
+  char       type[liu::layout_field::NAME_LEN];
+  uint32_t   size;
+  uint16_t   fields;
+  uint16_t   reserved;
+  // layout_field[fields] followed by the struct itself
+  char       vla[0];
+
+  const liu::layout_field* layout() const noexcept {
+    return (const liu::layout_field*) vla;
+  }
+  const char* data() const noexcept {
+    return &vla[fields * sizeof(liu::layout_field)];
+  }
+};
+
 struct storage_entry
 {
   storage_entry(int16_t type, uint16_t id, int length);
@@ -71,35 +217,81 @@ struct storage_entry
   uint32_t       checksum() const;
 };
 
+// failures while storing, reported by finalize()
+enum store_failure : uint32_t {
+  STORE_OK = 0,
+  STORE_NEEDS_SECTIONS,
+  STORE_NEEDS_VERSION2,
+  STORE_OUTSIDE_MEMORY,
+  STORE_NOT_WRITABLE,
+};
+
+/**
+ * Version 1 is the legacy format: magic, crc, entries and length, with the
+ * entries following directly after. Version 2 and later have a new magic,
+ * and a header with feature flags, where readers must understand every
+ * required feature, and can ignore the optional ones. Newer versions can
+ * extend the header, since the entries always start at header_len.
+**/
 struct storage_header
 {
   typedef delegate<int(char*)> construct_func;
+  static const uint64_t  LEGACY_MAGIC;
   static const uint64_t  LIVEUPD_MAGIC;
+  static const uint16_t  VERSION_LEGACY  = 1;
+  static const uint16_t  VERSION_CURRENT = 2;
+  // the legacy header, and the length it was checksummed with
+  static const int       LEGACY_HEADER_LEN = 20;
+  static const int       LEGACY_CRC_LEN    = 24;
+  // required features
+  static const uint32_t  FEATURE_SECTIONS = 1u << 0;
+  static const uint32_t  SUPPORTED_FEATURES = FEATURE_SECTIONS;
+  // optional features
+  static const uint32_t  FEATURE_INDEX    = 1u << 0;
   
+  bool is_legacy() const noexcept {
+    return this->magic == LEGACY_MAGIC;
+  }
+  uint16_t get_version() const noexcept {
+    return is_legacy() ? VERSION_LEGACY : this->version;
+  }
+  size_t data_offset() const noexcept {
+    return is_legacy() ? LEGACY_HEADER_LEN : this->header_len;
+  }
   size_t get_length() const noexcept {
     return this->length;
   }
   size_t total_bytes() const noexcept {
-    return sizeof(storage_header) + get_length();
+    return data_offset() + get_length();
   }
   uint32_t get_entries() const noexcept {
     return this->entries;
   }
   
-  storage_header();
+  storage_header(uint16_t version = VERSION_CURRENT);
   
   void add_marker(uint16_t id);
+  void add_section(const char* name, size_t len);
+  void add_section(const std::string& name) {
+    add_section(name.data(), name.size());
+  }
   void add_int   (uint16_t id, int value);
-  void add_string(uint16_t id, const std::string& data);
+  void add_string(uint16_t id, const char*, size_t);
+  void add_string(uint16_t id, const std::string& data) {
+    add_string(id, data.data(), data.size());
+  }
   void add_buffer(uint16_t id, const char*, int);
   storage_entry& add_struct(int16_t type, uint16_t id, int length);
   storage_entry& add_struct(int16_t type, uint16_t id, construct_func);
   void add_vector(uint16_t, const void*, size_t cnt, size_t esize);
   void add_string_vector(uint16_t id, const std::vector<std::string>& vec);
-  void add_end();
+  void add_layout(uint16_t id, const char* type, const liu::layout_t&, const void*, int);
+  void add_end() noexcept;
   
   storage_entry* begin();
   storage_entry* next(storage_entry*);
+  // returns the section entry named @name, or nullptr
+  storage_entry* find_section(const std::string& name) noexcept;
   
   template <typename... Args>
   storage_entry& create_entry(Args&&... args);
@@ -108,22 +300,75 @@ struct storage_header
   var_entry(int16_t type, uint16_t id, construct_func func);
   
   void append_eof() noexcept {
-    ((storage_entry*) &vla[length])->type = TYPE_END;
+    ((storage_entry*) &data()[length])->type = TYPE_END;
+  }
+  // returns the reason the store failed, or nullptr. Never throws or
+  // allocates, since begin() stores with interrupts disabled
+  const char* finalize() noexcept;
+  // the bytes finalize() writes, ie. the section index with room for
+  // @more sections than started so far, the end entry and the EOF after it
+  size_t finalize_length(uint32_t more = 0) const noexcept {
+    const uint32_t sections = this->index + more;
+    if (is_legacy() || sections == 0) return 2 * sizeof(storage_entry);
+    return 3 * sizeof(storage_entry) + sizeof(section_index)
+         + index_capacity(sections) * sizeof(section_index::slot);
   }
-  void finalize();
   bool validate() noexcept;
+  // true if the magic is one this reader knows, before trusting the length
+  bool has_magic() const noexcept {
+    return this->magic == LIVEUPD_MAGIC || this->magic == LEGACY_MAGIC;
+  }
+  // copy the whole area to @dest, which must not overlap it, validating
+  // the copy in the same pass. Returns false if validation fails
+  bool relocate(void* dest) noexcept;
   
   // zero out the entire header and its data, for extra security
   void zero();
   
 private:
+  char* data() noexcept {
+    return (char*) this + data_offset();
+  }
+  bool     validate_header() const noexcept;
   uint32_t generate_checksum() noexcept;
+  size_t   checksum_length() const noexcept {
+    return (is_legacy() ? LEGACY_CRC_LEN : this->header_len) + this->length;
+  }
+  // the types known to readers from before versioned storage
+  static bool is_legacy_type(int16_t type) noexcept {
+    return type <= TYPE_INTEGER
+        || (type >= TYPE_STRING && type <= TYPE_STR_VECTOR)
+        || type == TYPE_TCP;
+  }
+  // entries the legacy reader does not know fail the store
+  void     check_type(int16_t type) noexcept {
+    if (is_legacy() && is_legacy_type(type) == false) fail(STORE_NEEDS_VERSION2);
+  }
+  void     add_index();
+  static uint32_t index_capacity(uint32_t sections) noexcept {
+    uint32_t capacity = 4;
+    while (capacity < sections * 2) capacity *= 2;
+    return capacity;
+  }
+  // the crc is unused until finalize(), and holds the first failure
+  // while storing instead, see store_failure
+  void     fail(uint32_t reason) noexcept {
+    if (this->crc == 0) this->crc = reason;
+  }
   
   uint64_t magic;
   uint32_t crc;
   uint32_t entries = 0;
   uint32_t length  = 0;
-  char     vla[0];
+  // not part of the legacy format, where the entries start here instead
+  uint16_t version;
+  uint16_t header_len;
+  uint32_t required;
+  uint32_t optional;
+  // number of sections while storing,
+  // and then the offset of the section index, if any
+  uint32_t index;
+  uint32_t reserved;
 };
 
 template <typename... Args>
@@ -131,8 +376,9 @@ inline storage_entry&
 storage_header::create_entry(Args&&... args)
 {
   // create entry
-  auto* entry = (storage_entry*) &vla[length];
+  auto* entry = (storage_entry*) &data()[length];
   new (entry) storage_entry(args...);
+  check_type(entry->type);
   // next storage_entry will be this much further out:
   this->length += entry->size();
   this->entries++;
@@ -145,8 +391,9 @@ inline storage_entry&
 storage_header::var_entry(int16_t type, uint16_t id, construct_func func)
 {
   // create entry
-  auto* entry = (storage_entry*) &vla[length];
+  auto* entry = (storage_entry*) &data()[length];
   new (entry) storage_entry(type, id, 0);
+  check_type(type);
   // determine and set size of entry
   entry->len = func(entry->vla);
   // next storage_entry will be this much further out:
@@ -156,3 +403,16 @@ storage_header::var_entry(int16_t type, uint16_t id, construct_func func)
   this->append_eof();
   return *entry;
 }
+
+struct journal_header
+{
+  static const uint64_t JOURNAL_MAGIC;
+
+  uint64_t magic;
+  uint32_t running;   // running CRC32 of the log
+  uint32_t sealed;    // final CRC32 of the log
+  uint32_t is_sealed;
+  uint32_t capacity;
+  // the records, in regular storage entry format
+  storage_header log;
+};
@@ -0,0 +1,94 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#include "telemetry.hpp"
+#include "liveupdate.hpp"
+#include "storage.hpp"
+#include <kernel/os.hpp>
+#include <timers>
+#include <algorithm>
+#include <cstring>
+
+namespace liu
+{
+Telemetry::Telemetry(net::Inet<net::IP4>& inet, net::ip4::Addr collector, uint16_t p)
+  : sock(inet.udp().bind()), dst(collector), port(p)
+{
+  dgram.magic   = TELEMETRY_MAGIC;
+  dgram.version = TELEMETRY_VERSION;
+  dgram.count   = 0;
+}
+Telemetry::~Telemetry()
+{
+  stop_flushing();
+  flush();
+}
+
+int64_t Telemetry::now() const noexcept
+{
+  return ts_base + OS::micros_since_boot();
+}
+
+void Telemetry::sample(uint16_t metric, double value)
+{
+  auto& s = dgram.samples[dgram.count++];
+  s.seq      = seq++;
+  s.ts       = now();
+  s.value    = value;
+  s.epoch    = epoch_;
+  s.metric   = metric;
+  s.reserved = 0;
+  if (dgram.count == telemetry_datagram::MAX_COUNT) flush();
+}
+
+void Telemetry::flush()
+{
+  if (dgram.count == 0) return;
+  sock.sendto(dst, port, &dgram, dgram.size());
+  dgram.count = 0;
+}
+void Telemetry::flush_every(std::chrono::milliseconds interval)
+{
+  stop_flushing();
+  timer = Timers::periodic(interval,
+    [this] (int) {
+      this->flush();
+    });
+}
+void Telemetry::stop_flushing() noexcept
+{
+  if (timer >= 0) Timers::stop(timer);
+  timer = -1;
+}
+
+void Storage::add_telemetry(uid id, Telemetry& telemetry)
+{
+  auto& dgram = telemetry.dgram;
+  auto& entry = hdr.add_struct(TYPE_TELEMETRY, id,
+                    sizeof(telemetry_entry) + dgram.count * sizeof(telemetry_sample));
+  auto* tent = (telemetry_entry*) entry.vla;
+  tent->seq   = telemetry.seq;
+  tent->epoch = telemetry.epoch_;
+  tent->count = dgram.count;
+  tent->ts    = telemetry.now();
+  // unsent samples go out with the first batch after the update
+  memcpy(tent->vla, dgram.samples, dgram.count * sizeof(telemetry_sample));
+}
+
+void Restore::as_telemetry(Telemetry& telemetry) const
+{
+  if (ent->type != TYPE_TELEMETRY)
+      throw std::runtime_error("Incorrect type: " + std::to_string(ent->type));
+  auto* tent = (const telemetry_entry*) ent->vla;
+  telemetry.seq     = tent->seq;
+  telemetry.epoch_  = tent->epoch + 1;
+  telemetry.ts_base = tent->ts - OS::micros_since_boot();
+
+  auto& dgram = telemetry.dgram;
+  dgram.count = std::min<uint32_t>(tent->count, telemetry_datagram::MAX_COUNT);
+  memcpy(dgram.samples, tent->vla, dgram.count * sizeof(telemetry_sample));
+}
+
+} // liu
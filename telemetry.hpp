@@ -0,0 +1,69 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#pragma once
+#ifndef LIVEUPDATE_TELEMETRY_HPP
+#define LIVEUPDATE_TELEMETRY_HPP
+
+#include "telemetry_wire.hpp"
+#include <net/inet4>
+#include <chrono>
+#include <cstdint>
+
+namespace liu
+{
+/**
+ * Low-overhead telemetry for update experiments.
+ *
+ * Samples are fixed-size binary records, batched into MTU-sized UDP
+ * datagrams sent from one persistent socket. Each sample carries a
+ * sequence number and the update epoch. It also carries a timestamp that
+ * continues from where the old service left off.
+ *
+ * Storing the exporter with Storage::add_telemetry() carries the sequence
+ * number, the epoch and any unsent samples across the update. The host
+ * side collector (collector.cpp) uses them to stitch the time series
+ * together across swaps and to detect lost datagrams. The datagram format
+ * is in telemetry_wire.hpp, which the collector includes.
+ *
+**/
+struct Telemetry
+{
+  Telemetry(net::Inet<net::IP4>&, net::ip4::Addr collector, uint16_t port);
+  // the flush timer refers to this object, so it is stopped, and what is
+  // left is sent, when the exporter is destroyed. Exporters are not copied
+  Telemetry(const Telemetry&) = delete;
+  Telemetry& operator= (const Telemetry&) = delete;
+  ~Telemetry();
+
+  // record a sample, sending the batch when a datagram is full
+  void sample(uint16_t metric, double value);
+  // send what has been batched so far
+  void flush();
+  // flush periodically from the event loop, until stopped
+  void flush_every(std::chrono::milliseconds);
+  void stop_flushing() noexcept;
+
+  uint64_t sequence() const noexcept { return seq; }
+  uint32_t epoch()    const noexcept { return epoch_; }
+
+private:
+  int64_t now() const noexcept;
+  friend struct Storage;
+  friend struct Restore;
+
+  net::UDPSocket&    sock;
+  net::ip4::Addr     dst;
+  uint16_t           port;
+  uint64_t           seq    = 0;
+  uint32_t           epoch_ = 0;
+  int64_t            ts_base = 0;
+  int                timer  = -1;
+  telemetry_datagram dgram;
+};
+
+} // liu
+
+#endif
@@ -0,0 +1,52 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#pragma once
+#ifndef LIVEUPDATE_TELEMETRY_WIRE_HPP
+#define LIVEUPDATE_TELEMETRY_WIRE_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+namespace liu
+{
+/**
+ * Telemetry datagram format, shared by liu::Telemetry (telemetry.hpp)
+ * and the host side collector (collector.cpp).
+ *
+**/
+static const uint32_t TELEMETRY_MAGIC   = 0x5455494c; // "LIUT"
+static const uint16_t TELEMETRY_VERSION = 1;
+
+struct telemetry_sample
+{
+  uint64_t seq;
+  // microseconds, continued across updates
+  int64_t  ts;
+  double   value;
+  uint32_t epoch;
+  uint16_t metric;
+  uint16_t reserved;
+};
+
+struct telemetry_datagram
+{
+  // fits in a 1500 byte MTU with IP and UDP headers
+  static const int PAYLOAD   = 1500 - 20 - 8;
+  static const int MAX_COUNT = (PAYLOAD - 8) / sizeof(telemetry_sample);
+
+  uint32_t magic;
+  uint16_t version;
+  uint16_t count;
+  telemetry_sample samples[MAX_COUNT];
+
+  size_t size() const noexcept {
+    return 8 + count * sizeof(telemetry_sample);
+  }
+};
+
+} // liu
+
+#endif
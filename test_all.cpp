@@ -3,6 +3,11 @@
 #include <util/crc32.hpp>
 #include <cstdio>
 #include "liveupdate.hpp"
+#include "lease.hpp"
+#include "flows.hpp"
+#include "tls.hpp"
+#include "block_cache.hpp"
+#include "storage.hpp"
 #include "common.hpp"
 using namespace liu;
 
@@ -66,14 +71,27 @@ static void restore_term(Restore&);
 static void saved_message(Restore&);
 static void on_update_area(Restore&);
 static void on_missing(Restore&);
+static void test_legacy_format();
+static void prepare_state(net::Inet<net::IP4>&);
+static void restore_state(Restore&);
+static void restore_sessions(Restore&);
+static void restore_next_session(Restore&);
+static void restore_tls(Restore&);
 
 LiveUpdate::storage_func begin_test_all(net::Inet<net::IP4>& inet)
 {
+  // state stored by the next update, and compared against on resume
+  prepare_state(inet);
   /// attempt to resume (if there is anything to resume)
   LiveUpdate::on_resume(0,   strings_and_buffers);
   LiveUpdate::on_resume(100, the_timing);
   LiveUpdate::on_resume(665, saved_message);
-  LiveUpdate::on_resume(666, restore_term);
+  LiveUpdate::on_resume("test/terminals", 0, restore_term);
+  LiveUpdate::on_resume("test/tls", 0, restore_tls);
+  for (uint16_t id = 1; id <= 6; id++)
+      LiveUpdate::on_resume("test/state", id, restore_state);
+  LiveUpdate::on_resume("test/sessions", 0, restore_sessions);
+  LiveUpdate::on_resume("test/sessions/next", 0, restore_next_session);
   LiveUpdate::on_resume(999, on_update_area);
   // begin restoring saved data
   if (LiveUpdate::resume(LIVEUPD_LOCATION, on_missing) == false) {
@@ -81,6 +99,9 @@ LiveUpdate::storage_func begin_test_all(net::Inet<net::IP4>& inet)
     // .. logic for when there is nothing to resume yet
   }
 
+  // storing for a rollback to an older release
+  test_legacy_format();
+
   // listen for telnet clients
   setup_terminal(inet);
   // show profile stats for boot
@@ -92,20 +113,102 @@ LiveUpdate::storage_func begin_test_all(net::Inet<net::IP4>& inet)
 
 static std::vector<double> timestamps;
 
+// subsystem state for test_all_save(), filled in before resuming, so that
+// the resume handlers can compare against it
+static const int64_t SECOND = 1000000;
+static const size_t  BLOCK_SIZE = 512;
+static std::vector<ticket_key> ticket_keys(2);
+static flow_entry flows[2];
+static nat_entry  nats[1];
+static dhcp_lease lease;
+static std::vector<dns_record> dns_cache;
+static char         block_data[2][BLOCK_SIZE];
+static cached_block blocks[3];
+static tls_state    tls;
+static const liu::buffer_t tls_in  {'i', 'n'};
+static const liu::buffer_t tls_out {'o', 'u', 't'};
+static const std::vector<Connection_ptr> no_conns;
+
+static void prepare_state(net::Inet<net::IP4>& inet)
+{
+  for (size_t i = 0; i < ticket_keys.size(); i++) {
+    memset(&ticket_keys[i], 0, sizeof(ticket_key));
+    ticket_keys[i].name[0] = i + 1;
+    memset(ticket_keys[i].aes_key,  0xa0 + i, sizeof(ticket_key::aes_key));
+    memset(ticket_keys[i].hmac_key, 0xb0 + i, sizeof(ticket_key::hmac_key));
+  }
+  for (int i = 0; i < 2; i++) {
+    flows[i].orig_src  = net::Socket({10,0,0,2}, 1000 + i);
+    flows[i].orig_dst  = net::Socket({10,0,0,1}, 80);
+    flows[i].reply_src = flows[i].orig_dst;
+    flows[i].reply_dst = flows[i].orig_src;
+    flows[i].proto = 6;
+    flows[i].state = i;
+    flows[i].flags = 0;
+  }
+  nats[0].internal = net::Socket({10,0,0,2}, 2000);
+  nats[0].external = net::Socket({10,0,0,42}, 40000);
+  nats[0].proto = 17;
+  // the current configuration, so that applying it changes nothing
+  lease = {inet.ip_addr(), inet.netmask(), inet.gateway(), inet.dns_addr(),
+           {10,0,0,1}, 0, 0};
+  dns_cache = {{"includeos.org", {10,0,0,80}, 0},
+               {"example.org",   {10,0,0,81}, 0}};
+  memset(block_data[0], 'B', BLOCK_SIZE);
+  memset(block_data[1], 'C', BLOCK_SIZE);
+  // the middle block is stored as a reference only
+  blocks[0] = {7, block_data[0]};
+  blocks[1] = {8, nullptr};
+  blocks[2] = {9, block_data[1]};
+  memset(&tls, 0, sizeof(tls));
+  tls.version      = 0x0303;
+  tls.cipher_suite = 0xc02f;
+  tls.read_seq     = 11;
+  tls.write_seq    = 12;
+  memset(tls.read_key,  0x5e, sizeof(tls.read_key));
+  memset(tls.write_key, 0x5f, sizeof(tls.write_key));
+}
+// expiry times relative to when they are stored
+static void set_expiry()
+{
+  const int64_t now = OS::micros_since_boot();
+  ticket_keys[0].expires = now + 60 * SECOND;
+  ticket_keys[1].expires = now + 120 * SECOND;
+  flows[0].expires = now + 30 * SECOND;
+  flows[1].expires = now + 40 * SECOND;
+  nats[0].expires  = now + 45 * SECOND;
+  lease.renew      = now + 300 * SECOND;
+  lease.expires    = now + 600 * SECOND;
+  dns_cache[0].expires = now + 90 * SECOND;
+  // expired records are dropped on resume
+  dns_cache[1].expires = now - SECOND;
+}
+// the clock started over after the update, which took less than 5 seconds
+static void check_remaining(int64_t expires, int64_t secs)
+{
+  const int64_t left = expires - OS::micros_since_boot();
+  assert(left <= secs * SECOND && left > (secs - 5) * SECOND);
+}
+
+// built before the update, since the storage callback must not allocate
+static const std::vector<std::string> strvec {
+  "|String 1|",
+  "|String 2 is slightly longer|"
+};
+
 void test_all_save(liu::Storage& storage, const liu::buffer_t* final_blob)
 {
   storage.add_int(0, 1234);
   storage.add_int(0, 5678);
 
-  storage.add_string(1, "Some string :(");
-  storage.add_string(1, "Some other string :(");
+  static const char str1[] = "Some string :(";
+  static const char str2[] = "Some other string :(";
+  storage.add_string(1, str1, sizeof(str1)-1);
+  storage.add_string(1, str2, sizeof(str2)-1);
 
   const char buffer[] = "Just some random buffer";
   storage.add_buffer(1, buffer, sizeof(buffer));
 
-  std::vector<std::string> strvec;
-  strvec.push_back("|String 1|");
-  strvec.push_back("|String 2 is slightly longer|");
   storage.add_vector<std::string> (1, strvec);
 
   // store current timestamp using same ID = 100
@@ -121,10 +224,190 @@ void test_all_save(liu::Storage& storage, const liu::buffer_t* final_blob)
   // messages received from terminals
   storage.add_vector<std::string> (665, savemsg);
 
-  // open terminals
+  // subsystem state, with expiry times that are rebased on the new clock
+  storage.section("test/state");
+  set_expiry();
+  storage.add_ticket_keys(1, ticket_keys);
+  storage.add_flows(2, flows, 2);
+  storage.add_nat(3, nats, 1);
+  storage.add_lease(4, lease);
+  storage.add_dns_cache(5, dns_cache);
+  storage.add_block_cache(6, BLOCK_SIZE, blocks, 3);
+
+  // a run of sessions that ends at a section boundary
+  storage.section("test/sessions");
+  for (int i = 0; i < 3; i++)
+    storage.add_session(0, no_conns, i);
+  storage.section("test/sessions/next");
+  storage.add_session(0, no_conns, 3);
+
+  // the first open terminal, as if it were a TLS stream
+  Connection_ptr tls_conn = nullptr;
+  storage.section("test/tls");
+  for (auto conn : saveme)
+    if (conn->is_connected()) {
+      storage.add_tls_connection(0, conn, tls, tls_in, tls_out);
+      tls_conn = conn;
+      break;
+    }
+
+  // open terminals, in their own id space
+  storage.section("test/terminals");
   for (auto conn : saveme)
-    if (conn->is_connected())
-      storage.add_connection(666, conn);
+    if (conn != tls_conn && conn->is_connected())
+      storage.add_connection(0, conn);
+}
+
+struct legacy_t
+{
+  int64_t  value;
+  int32_t  count;
+};
+LIU_LAYOUT(legacy_t,
+    LIU_FIELD(legacy_t, value),
+    LIU_FIELD(legacy_t, count))
+static const legacy_t legacy_struct {0x1234567890, 42};
+
+// the types known to releases from before versioned storage
+static bool baseline_type(int16_t type)
+{
+  switch (type) {
+  case TYPE_END: case TYPE_MARKER: case TYPE_INTEGER:
+  case TYPE_STRING: case TYPE_BUFFER: case TYPE_VECTOR: case TYPE_STR_VECTOR:
+  case TYPE_TCP:
+    return true;
+  }
+  return false;
+}
+
+void test_legacy_format()
+{
+  static char area[4096] __attribute__((aligned(16)));
+  LiveUpdate::set_target_format(LiveUpdate::FORMAT_LEGACY);
+  LiveUpdate::store(area,
+  [] (Storage& storage, const buffer_t*) {
+    storage.add_int(1, 1234);
+    storage.add_struct(2, legacy_struct);
+    storage.put_marker(10);
+  });
+  // read it back the way the old reader does
+  auto* hdr = (storage_header*) area;
+  assert(hdr->is_legacy() && hdr->validate());
+  int n = 0;
+  for (auto* ent = hdr->begin(); ent->type != TYPE_END; ent = hdr->next(ent), n++)
+  {
+    assert(baseline_type(ent->type));
+    if (n == 1) {
+      // as_type<legacy_t>() in the old release
+      assert(ent->type == TYPE_BUFFER && ent->len == sizeof(legacy_t));
+      assert(memcmp(ent->vla, &legacy_struct, sizeof(legacy_t)) == 0);
+    }
+  }
+  assert(n == 3);
+
+  // anything else fails the store, instead of confusing the old reader
+  bool failed = false;
+  try {
+    LiveUpdate::store(area,
+    [] (Storage& storage, const buffer_t*) {
+      storage.add_lease(1, dhcp_lease {});
+    });
+  }
+  catch (const std::runtime_error&) {
+    failed = true;
+  }
+  assert(failed);
+  LiveUpdate::set_target_format(LiveUpdate::FORMAT_CURRENT);
+  printf("* Legacy storage format verified\n");
+}
+
+void restore_state(liu::Restore& thing)
+{
+  switch (thing.get_id()) {
+  case 1: {
+    auto keys = thing.as_ticket_keys();
+    assert(keys.size() == 2);
+    for (size_t i = 0; i < keys.size(); i++) {
+      assert(keys[i].name[0] == i + 1);
+      assert(memcmp(keys[i].aes_key, ticket_keys[i].aes_key, sizeof(ticket_key::aes_key)) == 0);
+      assert(memcmp(keys[i].hmac_key, ticket_keys[i].hmac_key, sizeof(ticket_key::hmac_key)) == 0);
+    }
+    check_remaining(keys[0].expires, 60);
+    check_remaining(keys[1].expires, 120);
+    } break;
+  case 2: {
+    auto table = thing.as_flows();
+    assert(table.size() == 2);
+    assert(table[1].orig_src.port() == 1001 && table[1].state == 1);
+    check_remaining(table[0].expires, 30);
+    check_remaining(table[1].expires, 40);
+    } break;
+  case 3: {
+    auto table = thing.as_nat();
+    assert(table.size() == 1);
+    assert(table[0].external.port() == 40000 && table[0].proto == 17);
+    check_remaining(table[0].expires, 45);
+    } break;
+  case 4: {
+    auto restored = thing.as_lease();
+    assert(restored.address == lease.address && restored.server == lease.server);
+    check_remaining(restored.renew, 300);
+    check_remaining(restored.expires, 600);
+    // still valid, so the stack is configured without DHCP
+    auto& inet = net::Inet4::stack<0> ();
+    assert(apply_lease(inet, restored, [] { printf("* Lease due for renewal\n"); }));
+    } break;
+  case 5: {
+    auto cache = thing.as_dns_cache();
+    assert(cache.size() == 1 && cache[0].name == "includeos.org");
+    check_remaining(cache[0].expires, 90);
+    } break;
+  case 6: {
+    int n = 0;
+    size_t count = thing.as_block_cache(
+    [&n] (uint64_t block, const void* data, size_t len) {
+      assert(block == (uint64_t) 7 + n && len == BLOCK_SIZE);
+      if (block == 8) assert(data == nullptr);
+      else assert(((const char*) data)[len-1] == (block == 7 ? 'B' : 'C'));
+      n++;
+    });
+    assert(count == 3 && n == 3);
+    } break;
+  }
+  printf("* Restored subsystem state %u\n", thing.get_id());
+}
+void restore_sessions(liu::Restore& thing)
+{
+  auto& stack = net::Inet4::stack<0> ();
+  int next = 0;
+  size_t count = thing.as_sessions(stack.tcp(),
+  [&next] (auto& conns, const void* meta, size_t len) {
+    assert(conns.empty() && len == sizeof(int));
+    assert(*(const int*) meta == next++);
+  });
+  // the last session is in the next section
+  assert(count == 3);
+}
+void restore_next_session(liu::Restore& thing)
+{
+  auto& stack = net::Inet4::stack<0> ();
+  size_t count = thing.as_sessions(stack.tcp(),
+  [] (auto&, const void* meta, size_t) {
+    assert(*(const int*) meta == 3);
+  });
+  assert(count == 1);
+  printf("* Restored sessions across a section boundary\n");
+}
+void restore_tls(liu::Restore& thing)
+{
+  auto& stack = net::Inet4::stack<0> ();
+  tls_state state;
+  liu::buffer_t in, out;
+  auto conn = thing.as_tls_connection(stack.tcp(), state, in, out);
+  assert(memcmp(&state, &tls, sizeof(tls_state)) == 0);
+  assert(in == tls_in && out == tls_out);
+  setup_terminal_connection(conn);
+  printf("Restored TLS terminal connection to %s\n", conn->remote().to_string().c_str());
 }
 
 void strings_and_buffers(liu::Restore& thing)
@@ -0,0 +1,115 @@
+#include <kernel/os.hpp>
+#include <algorithm>
+#include <cstring>
+#include "liveupdate.hpp"
+#include "storage.hpp"
+#include "common.hpp"
+using namespace liu;
+
+// memory bandwidth of each data-movement step in the store/swap/resume path
+// compared with plain memcpy and memset, for sizes from 4kb to 1gb
+static const size_t MIN_SIZE = 4096;
+static const size_t MAX_SIZE = 1ull << 30;
+// repeat small sizes until at least this much has been moved
+static const size_t MIN_TOTAL = 256ull << 20;
+
+static char* src_area;
+static char* dst_area;
+
+static void rep_movsb(char* dst, const char* src, size_t len)
+{
+  // same copy as hotswap64
+  asm volatile("cld; rep movsb"
+      : "+D" (dst), "+S" (src), "+c" (len) : : "memory");
+}
+
+static void evict(const char* area, size_t len)
+{
+  for (size_t i = 0; i < len; i += 64)
+    asm volatile("clflush (%0)" : : "r" (&area[i]) : "memory");
+  asm volatile("mfence" : : : "memory");
+}
+
+typedef delegate<void(size_t)> bench_func;
+
+static double measure(size_t len, bool cold, bench_func setup, bench_func func)
+{
+  const size_t rounds = std::max<size_t>(1, MIN_TOTAL / len);
+  int64_t total = 0;
+  for (size_t i = 0; i < rounds; i++)
+  {
+    if (setup) setup(len);
+    if (cold) {
+      evict(src_area, len + sizeof(storage_header) + sizeof(storage_entry));
+      evict(dst_area, len + sizeof(storage_header) + sizeof(storage_entry));
+    }
+    const int64_t t0 = OS::cycles_since_boot();
+    func(len);
+    total += OS::cycles_since_boot() - t0;
+  }
+  const double secs = total / (OS::cpu_freq().count() * 1e6);
+  return (rounds * len) / secs / 1e9;
+}
+
+static void report(const char* name, size_t len, bench_func setup, bench_func func)
+{
+  const double warm = measure(len, false, setup, func);
+  const double cold = measure(len, true,  setup, func);
+  printf("%-12s %10zu kb  warm %7.2f GB/s  cold %7.2f GB/s\n",
+          name, len / 1024, warm, cold);
+}
+
+static void run_benchmarks(size_t max_size)
+{
+  auto* storage = (storage_header*) dst_area;
+
+  for (size_t len = MIN_SIZE; len <= max_size; len *= 2)
+  {
+    // roofline
+    report("memcpy", len, nullptr,
+      [] (size_t len) { memcpy(dst_area, src_area, len); });
+    report("memset", len, nullptr,
+      [] (size_t len) { memset(dst_area, 0, len); });
+    // Storage::add_buffer
+    report("add_buffer", len,
+      [storage] (size_t) { new (storage) storage_header(); },
+      [storage] (size_t len) { storage->add_buffer(0, src_area, len); });
+    // CRC pass of is_resumable()
+    report("crc32", len,
+      [storage] (size_t len) {
+        new (storage) storage_header();
+        storage->add_buffer(0, src_area, len);
+        storage->finalize();
+      },
+      [storage] (size_t) { storage->validate(); });
+    // the kernel copy in hotswap64
+    report("rep movsb", len, nullptr,
+      [] (size_t len) { rep_movsb(dst_area, src_area, len); });
+    // zero() after resume
+    report("zero", len,
+      [storage] (size_t len) {
+        new (storage) storage_header();
+        storage->add_buffer(0, src_area, len);
+      },
+      [storage] (size_t) { storage->zero(); });
+  }
+}
+
+LiveUpdate::storage_func begin_test_bench()
+{
+  // use the memory above the storage location, which is outside the heap
+  const size_t avail = OS::heap_max() - (uintptr_t) LIVEUPD_LOCATION;
+  size_t max_size = MIN_SIZE;
+  while (max_size * 2 <= MAX_SIZE && (max_size * 2 + 0x10000) * 2 <= avail)
+    max_size *= 2;
+
+  dst_area = (char*) LIVEUPD_LOCATION;
+  src_area = dst_area + max_size + 0x10000;
+  memset(src_area, 'A', max_size);
+
+  printf("Benchmarking %zu kb to %zu kb (CPU freq: %.0f MHz)\n",
+          MIN_SIZE / 1024, max_size / 1024, OS::cpu_freq().count());
+  run_benchmarks(max_size);
+  OS::shutdown();
+  return nullptr;
+}
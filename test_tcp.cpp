@@ -3,6 +3,7 @@
 #include <statman>
 #include <timers>
 #include "liveupdate.hpp"
+#include "telemetry.hpp"
 #include "common.hpp"
 using namespace liu;
 using namespace net;
@@ -15,6 +16,7 @@ static void setup_callbacks(tcp::Connection_ptr);
 static void open_for_business(net::TCP& tcp, uint16_t port);
 static bool updated_yet = false;
 static int  measuring_timer = -1;
+static std::unique_ptr<Telemetry> telemetry = nullptr;
 
 struct measurement_t
 {
@@ -23,6 +25,11 @@ struct measurement_t
   int64_t  ts = 0;
   int      expr = 0;
 };
+LIU_LAYOUT(measurement_t,
+    LIU_FIELD(measurement_t, received),
+    LIU_FIELD(measurement_t, received_last),
+    LIU_FIELD(measurement_t, ts),
+    LIU_FIELD(measurement_t, expr))
 static measurement_t measurement;
 
 static void start_measuring() {
@@ -48,9 +55,7 @@ static void take_measure() {
   //printf("Duration: %.2f s - Payload: %lld MB - %.2f MBit/s\n",
   //        secs, measurement.received/(1024*1024), mbits);
   printf("%f\n", mbits);
-  auto data = std::to_string(mbits) + "\n";
-  auto& sock = inet_ptr->udp().bind();
-  sock.sendto({10,0,0,1}, 667, data.data(), data.size());
+  telemetry->sample(0, mbits);
 }
 static void begin_measurements()
 {
@@ -68,7 +73,10 @@ static void tcpflow_save(Storage& storage, const buffer_t* blob)
 
   storage.add_connection(0, conn);
   storage.add_buffer(1, *blob);
-  storage.add(2, measurement);
+  storage.add_struct(2, measurement);
+  // releases from before telemetry cannot read it, see tcpflow_resume()
+  if (LiveUpdate::get_target_format() != LiveUpdate::FORMAT_LEGACY)
+      storage.add_telemetry(3, *telemetry);
   storage.put_marker(10);
 }
 
@@ -79,7 +87,15 @@ static void tcpflow_resume(Restore& thing)
   thing.go_next();
   bloberino = thing.as_buffer();
   thing.go_next();
-  measurement = thing.as_type<measurement_t> ();
+  // services from before layouts and telemetry stored the plain struct,
+  // followed directly by the marker
+  if (thing.is_struct())
+      measurement = thing.as_struct<measurement_t> ();
+  else
+      measurement = thing.as_type<measurement_t> ();
+  thing.go_next();
+  if (thing.is_marker() == false)
+      thing.as_telemetry(*telemetry);
   thing.pop_marker(10);
   updated_yet = true;
 }
@@ -97,6 +113,7 @@ void setup_callbacks(tcp::Connection_ptr conn)
       Timers::stop(measuring_timer);
       // measure one last time
       take_measure();
+      telemetry->flush();
       // close this shit down
       ::conn->close();
       // reopen transfer port
@@ -112,7 +129,7 @@ static void setup_liveupdate_server(net::Inet<net::IP4>& inet)
 {
   // listen for live updates
   server(inet, 666,
-  [] (liu::buffer_t& buffer) {
+  [] (liu::buffer_t& buffer, const liu::verified_image&) {
     // set blob
     printf("LiveUpdate blob received! Send file now...\n");
     bloberino = buffer;
@@ -157,6 +174,9 @@ LiveUpdate::storage_func begin_test_tcpflow(net::Inet<net::IP4>& inet)
 {
   tcp_ptr = &inet.tcp();
   inet_ptr = &inet;
+  // samples go to collector.cpp on the host
+  telemetry.reset(new Telemetry(inet, {10,0,0,1}, 667));
+  telemetry->flush_every(std::chrono::seconds(1));
 
   bool resumed = LiveUpdate::resume(LIVEUPD_LOCATION, tcpflow_resume);
   if (resumed == false)
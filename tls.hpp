@@ -0,0 +1,65 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#pragma once
+#ifndef LIVEUPDATE_TLS_HPP
+#define LIVEUPDATE_TLS_HPP
+
+#include <cstdint>
+
+namespace liu
+{
+/**
+ * TLS state for encrypted connections and session tickets.
+ *
+ * Storage::add_tls_connection() stores the state of an established TLS
+ * stream together with its TCP connection in one entry, including any
+ * records that were buffered but not yet processed in either direction.
+ * Restore::as_tls_connection() gives back both, and the TLS layer can
+ * continue on the restored connection without a new handshake.
+ *
+ * Session ticket keys are stored with Storage::add_ticket_keys(), so that
+ * the new service can decrypt tickets issued before the update, and
+ * clients can resume their sessions. Expiry times are stored as remaining
+ * time, like in flows.hpp.
+ *
+ * The TLS library fills in and consumes these structs. The storage area
+ * is zeroed after resume, so no key material is left behind.
+ *
+**/
+struct tls_state
+{
+  uint16_t version;
+  uint16_t cipher_suite;
+  uint8_t  key_len;
+  uint8_t  iv_len;
+  uint8_t  mac_len;
+  uint8_t  flags;
+  // record sequence numbers
+  uint64_t read_seq;
+  uint64_t write_seq;
+  // traffic keys in each direction
+  uint8_t  read_key[32];
+  uint8_t  write_key[32];
+  uint8_t  read_iv[16];
+  uint8_t  write_iv[16];
+  uint8_t  read_mac[48];
+  uint8_t  write_mac[48];
+  // for renegotiation and key updates
+  uint8_t  master_secret[48];
+};
+
+struct ticket_key
+{
+  uint8_t  name[16];
+  uint8_t  aes_key[32];
+  uint8_t  hmac_key[32];
+  // expiry time in OS::micros_since_boot()
+  int64_t  expires;
+};
+
+} // liu
+
+#endif
@@ -7,13 +7,22 @@
 
 #include <cassert>
 #include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <stdexcept>
 #include <string>
 #include <unistd.h>
 #include "elf.h"
+#include "blackout.hpp"
+#include "handoff.hpp"
+#include "image.hpp"
+#include "inflight.hpp"
+#include "signature.hpp"
 #include "storage.hpp"
+#include <util/crc32.hpp>
 #include <kernel/os.hpp>
 #include <hw/devices.hpp>
+#include <timers>
 
 //#define LPRINT(x, ...) printf(x, ##__VA_ARGS__);
 #define LPRINT(x, ...) /** x **/
@@ -37,10 +46,51 @@ extern char* heap_begin;
 extern char* heap_end;
 // turn this off to reduce liveupdate times at the cost of extra checks
 bool LIVEUPDATE_PERFORM_SANITY_CHECKS = true;
+// incremented by every store, see arena.cpp
+uint32_t LIVEUPDATE_STORE_GENERATION = 0;
+// storage format written by begin() and store(), see set_target_format()
+static uint16_t target_format = storage_header::VERSION_CURRENT;
+// set between cli and the swap in begin(), where nothing may allocate
+// or throw. Allocations are counted by alloc_hook.cpp in debug builds
+bool     LIVEUPDATE_CRITICAL_SECTION = false;
+uint32_t LIVEUPDATE_CRITICAL_ALLOCS  = 0;
+#ifdef LIVEUPDATE_DEBUG_ALLOC
+// failures in the critical section are formatted here, since the heap
+// cannot be used until interrupts are enabled again
+static char critical_reason[128];
+static const char* critical_allocs() noexcept
+{
+  if (LIVEUPDATE_CRITICAL_ALLOCS == 0) return nullptr;
+  snprintf(critical_reason, sizeof(critical_reason),
+      "LiveUpdate allocated %u times with interrupts disabled",
+      LIVEUPDATE_CRITICAL_ALLOCS);
+  return critical_reason;
+}
+#endif
 
 using namespace liu;
 
 static size_t update_store_data(void* location, LiveUpdate::storage_func, const buffer_t*);
+// why the last store failed, when update_store_data() returns zero
+static const char* store_failure = nullptr;
+
+static void enter_critical_section() noexcept
+{
+  asm volatile("cli");
+  LIVEUPDATE_CRITICAL_ALLOCS  = 0;
+  LIVEUPDATE_CRITICAL_SECTION = true;
+}
+static void leave_critical_section() noexcept
+{
+  LIVEUPDATE_CRITICAL_SECTION = false;
+  asm volatile("sti");
+}
+// the exception is only created once interrupts are enabled again
+[[noreturn]] static void critical_failure(const char* reason)
+{
+  leave_critical_section();
+  throw std::runtime_error(reason);
+}
 
 template <typename Class>
 inline bool validate_header(const Class* hdr)
@@ -51,42 +101,46 @@ inline bool validate_header(const Class* hdr)
            hdr->e_ident[3] == 'F';
 }
 
-void LiveUpdate::begin(void*        location,
-                       buffer_t     blob,
-                       storage_func storage_callback)
+struct image_info
 {
-  LPRINT("LiveUpdate::begin(%p, %p:%d, ...)\n", location, blob.data(), (int) blob.size());
-  // 1. turn off interrupts
-  asm volatile("cli");
-
-  // use area provided to us directly, which we will assume
-  // is far enough into heap to not get overwritten by hotswap.
-  // even then, it's still guaranteed to work: the copy mechanism
-  // is implemented in hotswap.cpp and copies forwards. the
-  // blobs are separated by at least one old kernel size and
-  // some early heap allocations, which is at least 1mb, while
-  // the copy mechanism just copies single bytes.
-  const char* update_area  = blob.data();
-  char* storage_area = (char*) location;
+  const char* bin_data  = nullptr;
+  int         bin_len   = 0;
+  char*       phys_base = nullptr;
+  uintptr_t   start_offset = 0;
+};
 
-  // validate not overwriting heap, kernel area and other things
-  if (storage_area < (char*) 0x200) {
-    throw std::runtime_error("LiveUpdate storage area is (probably) a null pointer");
-  }
-  if (storage_area >= &_ELF_START_ && storage_area < &_end) {
-    throw std::runtime_error("LiveUpdate storage area is inside kernel area");
-  }
-  if (storage_area >= heap_begin && storage_area < heap_end) {
-    throw std::runtime_error("LiveUpdate storage area is inside the heap area");
+static image_info parse_compact_image(const buffer_t& blob)
+{
+  const auto* hdr = (const liu_image_header*) blob.data();
+  LPRINT("* Found compact image header\n");
+  // the hotswap copies a single contiguous area
+  if (hdr->segments != 1 || blob.size() < hdr->header_length()) {
+    throw std::runtime_error("Compact image must have exactly one load segment");
   }
-  if (storage_area >= (char*) OS::heap_max()) {
-    throw std::runtime_error("LiveUpdate storage area is outside physical memory");
+  const auto& seg = hdr->segment[0];
+  if (blob.size() < hdr->length || seg.offset + seg.filesz > hdr->length)
+  {
+    fprintf(stderr,
+        "*** There was a mismatch between blob length and expected image size:\n");
+    fprintf(stderr,
+        "EXPECTED: %u byte\n",  (uint32_t) hdr->length);
+    fprintf(stderr,
+        "ACTUAL:   %u bytes\n", (uint32_t) blob.size());
+    throw std::runtime_error("Compact image was incomplete");
   }
-  if (storage_area >= (char*) OS::heap_max() - 0x10000) {
-    throw std::runtime_error("LiveUpdate storage area needs at least 64kb memory");
+  const char* bin_data = &blob[seg.offset];
+  if (LIVEUPDATE_PERFORM_SANITY_CHECKS)
+  {
+    if (crc32_fast(bin_data, seg.filesz) != hdr->crc)
+        throw std::runtime_error("Compact image failed checksum");
   }
+  return {bin_data, (int) seg.filesz, (char*) seg.paddr, (uintptr_t) hdr->entry};
+}
 
+static image_info parse_elf_image(const buffer_t& blob)
+{
   // search for ELF header
+  const char* update_area = blob.data();
   LPRINT("* Looking for ELF header at %p\n", update_area);
   const char* binary  = &update_area[0];
   const auto* hdr = (const Elf32_Ehdr*) binary;
@@ -152,59 +206,298 @@ void LiveUpdate::begin(void*        location,
     throw std::runtime_error("ELF file was incomplete");
   }
   LPRINT("* Validated ELF header\n");
+  return {bin_data, bin_len, phys_base, start_offset};
+}
 
-  // _start() entry point
-  LPRINT("* _start is located at %#x\n", start_offset);
+void LiveUpdate::begin(void*        location,
+                       buffer_t     blob,
+                       storage_func storage_callback)
+{
+  begin(location, std::move(blob), verified_image(), storage_callback);
+}
 
-  // save ourselves if function passed
-  update_store_data(storage_area, storage_callback, &blob);
+void LiveUpdate::begin(void*        location,
+                       buffer_t     blob,
+                       const verified_image& verified,
+                       storage_func storage_callback)
+{
+  LPRINT("LiveUpdate::begin(%p, %p:%d, ...)\n", location, blob.data(), (int) blob.size());
+  // verify images while interrupts are still enabled, unless this very
+  // buffer was verified while it was streaming in
+  if (has_verification_key() && verified.matches(blob) == false
+   && verify_image(blob) == false) {
+    throw std::runtime_error("LiveUpdate image has no valid signature");
+  }
+  // use area provided to us directly, which we will assume
+  // is far enough into heap to not get overwritten by hotswap.
+  // even then, it's still guaranteed to work: the copy mechanism
+  // is implemented in hotswap.cpp and copies forwards. the
+  // blobs are separated by at least one old kernel size and
+  // some early heap allocations, which is at least 1mb, while
+  // the copy mechanism just copies single bytes.
+  const char* update_area  = blob.data();
+  char* storage_area = (char*) location;
+
+  // validate not overwriting heap, kernel area and other things
+  if (storage_area < (char*) 0x200) {
+    throw std::runtime_error("LiveUpdate storage area is (probably) a null pointer");
+  }
+  if (storage_area >= &_ELF_START_ && storage_area < &_end) {
+    throw std::runtime_error("LiveUpdate storage area is inside kernel area");
+  }
+  if (storage_area >= heap_begin && storage_area < heap_end) {
+    throw std::runtime_error("LiveUpdate storage area is inside the heap area");
+  }
+  if (storage_area >= (char*) OS::heap_max()) {
+    throw std::runtime_error("LiveUpdate storage area is outside physical memory");
+  }
+  if (storage_area >= (char*) OS::heap_max() - 0x10000) {
+    throw std::runtime_error("LiveUpdate storage area needs at least 64kb memory");
+  }
+
+  // compact images need no parsing, and ELF is the fallback
+  image_info image;
+  const auto* compact = (const liu_image_header*) update_area;
+  if (blob.size() >= sizeof(liu_image_header) && compact->is_valid())
+  {
+#ifdef PLATFORM_x86_solo5
+    // solo5_exec() loads the new service as ELF
+    throw std::runtime_error("Compact images are not supported on solo5");
+#endif
+    image = parse_compact_image(blob);
+  }
+  else
+      image = parse_elf_image(blob);
+
+  // get offsets for the new service from program header
+  if (image.bin_data == nullptr ||
+      image.phys_base == nullptr || image.bin_len <= 64) {
+    throw std::runtime_error("ELF program header malformed");
+  }
+  // _start() entry point
+  LPRINT("* _start is located at %#x\n", image.start_offset);
+  // connections stored during the update are accounted for
+  blackout_reserve();
+
+  // 1. turn off interrupts. Until the swap nothing may allocate or throw,
+  // so failures go through critical_failure() instead
+  enter_critical_section();
+
+  // save ourselves if function passed, then flush all devices
+  // and capture the packets that are still in flight
+  size_t stored;
+  try {
+    stored = update_store_data(storage_area, storage_callback, &blob);
+  }
+  catch (...) {
+#ifdef LIVEUPDATE_DEBUG_ALLOC
+    // the exception itself was allocated with interrupts disabled
+    const char* allocs = critical_allocs();
+    if (allocs != nullptr) critical_failure(allocs);
+#endif
+    // rethrowing the storage callback's own exception allocates nothing
+    leave_critical_section();
+    throw;
+  }
+  if (stored == 0) {
+    critical_failure(store_failure);
+  }
 
-  // 2. flush all devices with flush() interface
-  hw::Devices::flush_all();
   // 3. deactivate all PCI devices and mask all MSI-X vectors
   // NOTE: there are some nasty side effects from calling this
   //hw::Devices::deactivate_all();
 
   // store soft-resetting stuff
 #ifdef PLATFORM_x86_solo5
-  void* sr_data = nullptr;
+  // the tender keeps guest memory across exec, see handoff.hpp
+  extern const std::pair<const char*, size_t> get_rollback_location();
+  if (store_handoff(storage_area, get_rollback_location()) == nullptr) {
+    critical_failure("LiveUpdate storage area overlaps the solo5 handoff block");
+  }
 #else
   extern const std::pair<const char*, size_t> get_rollback_location();
   const auto rollback = get_rollback_location();
   void* sr_data = __os_store_soft_reset(rollback.first, rollback.second);
 #endif
 
-  // get offsets for the new service from program header
-  if (bin_data == nullptr ||
-      phys_base == nullptr || bin_len <= 64) {
-    throw std::runtime_error("ELF program header malformed");
+#ifdef LIVEUPDATE_DEBUG_ALLOC
+  // fail loudly, so that the offending allocation can be found and removed.
+  // Allocations in the storage callbacks have already failed the store,
+  // before the devices were flushed. Those found here were made by the
+  // flush or the in-flight capture, and the devices stay flushed
+  if (critical_allocs() != nullptr) {
+    critical_failure(critical_reason);
   }
+#endif
 
   //char* phys_base = (char*) (start_offset & 0xffff0000);
-  LPRINT("* Physical base address is %p...\n", phys_base);
+  LPRINT("* Physical base address is %p...\n", image.phys_base);
 
   // replace ourselves and reset by jumping to _start
-  LPRINT("* Replacing self with %d bytes and jumping to %#x\n", bin_len, start_offset);
+  LPRINT("* Replacing self with %d bytes and jumping to %#x\n", image.bin_len, image.start_offset);
 
 #ifdef PLATFORM_x86_solo5
   solo5_exec(blob.data(), blob.size());
-  throw std::runtime_error("solo5_exec returned");
+  critical_failure("solo5_exec returned");
 #else
 # ifdef ARCH_i686
     // copy hotswapping function to sweet spot
     memcpy(HOTSWAP_AREA, (void*) &hotswap, &__hotswap_length - (char*) &hotswap);
     /// the end
-    ((decltype(&hotswap)) HOTSWAP_AREA)(bin_data, bin_len, phys_base, start_offset, sr_data);
+    ((decltype(&hotswap)) HOTSWAP_AREA)(image.bin_data, image.bin_len, image.phys_base, image.start_offset, sr_data);
 # elif defined(ARCH_x86_64)
     // copy hotswapping function to sweet spot
     memcpy(HOTSWAP_AREA, (void*) &hotswap64, hotswap64_len);
     /// the end
-    ((decltype(&hotswap64)) HOTSWAP_AREA)(phys_base, bin_data, bin_len, start_offset, sr_data);
+    ((decltype(&hotswap64)) HOTSWAP_AREA)(image.phys_base, image.bin_data, image.bin_len, image.start_offset, sr_data);
 # else
 #    error "Unimplemented architecture"
 # endif
 #endif
 }
+static std::vector<LiveUpdate::prepare_func> prepare_funcs;
+static std::chrono::milliseconds prepare_timeout {10000};
+static struct {
+  bool       active = false;
+  // ready calls from an earlier update are ignored
+  uint32_t   generation = 0;
+  size_t     next   = 0;
+  int        timer  = -1;
+  void*      location;
+  buffer_t   blob;
+  LiveUpdate::storage_func storage;
+  LiveUpdate::error_func   on_error;
+} pending;
+
+static void finish_prepare() noexcept
+{
+  pending.active = false;
+  pending.generation++;
+  if (pending.timer >= 0) Timers::stop(pending.timer);
+  pending.timer = -1;
+}
+
+static void prepare_next()
+{
+  if (pending.next < prepare_funcs.size())
+  {
+    const size_t   current = pending.next++;
+    const uint32_t generation = pending.generation;
+    try
+    {
+      prepare_funcs[current](
+      [current, generation] {
+        // ignore stale or repeated ready calls
+        if (pending.active && pending.generation == generation
+         && pending.next == current + 1) prepare_next();
+      });
+    }
+    catch (const std::exception& err)
+    {
+      // the update is abandoned, so that it can be attempted again.
+      // Updates cancelled meanwhile have nobody left to report to
+      if (pending.generation != generation) return;
+      finish_prepare();
+      pending.on_error(err);
+    }
+    return;
+  }
+  LPRINT("* All %u subsystems ready\n", (uint32_t) prepare_funcs.size());
+  finish_prepare();
+  try
+  {
+    LiveUpdate::begin(pending.location, std::move(pending.blob), pending.storage);
+  }
+  catch (const std::exception& err)
+  {
+    LiveUpdate::restore_environment();
+    pending.on_error(err);
+  }
+}
+
+void LiveUpdate::on_prepare(prepare_func func)
+{
+  prepare_funcs.push_back(func);
+}
+void LiveUpdate::begin_async(void*        location,
+                             buffer_t     blob,
+                             storage_func storage_callback,
+                             error_func   on_error)
+{
+  if (pending.active)
+      throw std::runtime_error("LiveUpdate is already preparing an update");
+  // failures happen from the event loop, where nothing can catch them
+  if (on_error == nullptr)
+      throw std::runtime_error("LiveUpdate::begin_async() needs an error handler");
+
+  pending.active   = true;
+  pending.next     = 0;
+  pending.location = location;
+  pending.blob     = std::move(blob);
+  pending.storage  = storage_callback;
+  pending.on_error = on_error;
+  // a prepare handler that never reports ready fails the update
+  const uint32_t generation = pending.generation;
+  pending.timer = Timers::oneshot(prepare_timeout,
+  [generation] (int) {
+    if (pending.active == false || pending.generation != generation) return;
+    pending.timer = -1;
+    finish_prepare();
+    pending.on_error(std::runtime_error("LiveUpdate prepare handler timed out"));
+  });
+  prepare_next();
+}
+bool LiveUpdate::cancel_async() noexcept
+{
+  if (pending.active == false) return false;
+  finish_prepare();
+  pending.blob = buffer_t();
+  return true;
+}
+void LiveUpdate::set_prepare_timeout(std::chrono::milliseconds timeout) noexcept
+{
+  prepare_timeout = timeout;
+}
+
+size_t LiveUpdate::image_length(const void* image)
+{
+  const char* area   = (const char*) image;
+  const auto* compact = (const liu_image_header*) area;
+  if (compact->is_valid()) return compact->length;
+
+  const char* binary = area;
+  auto* hdr = (const Elf32_Ehdr*) binary;
+  if (!validate_header<Elf32_Ehdr>(hdr))
+  {
+    /// try again with 1 sector offset (skip bootloader)
+    binary = &area[SECT_SIZE];
+    hdr    = (const Elf32_Ehdr*) binary;
+    if (!validate_header<Elf32_Ehdr>(hdr)) return 0;
+  }
+  /// note: this assumes section headers are at the end
+  size_t total;
+  if (hdr->e_ident[EI_CLASS] == ELFCLASS32) {
+    total = hdr->e_shnum * hdr->e_shentsize + hdr->e_shoff;
+  }
+  else {
+    auto* ehdr = (const Elf64_Ehdr*) hdr;
+    total = ehdr->e_shnum * ehdr->e_shentsize + ehdr->e_shoff;
+  }
+  // including the bootloader sector, if any
+  return (binary - area) + total;
+}
+
+void LiveUpdate::set_target_format(storage_format format)
+{
+  if (format < FORMAT_LEGACY || format > FORMAT_CURRENT)
+      throw std::runtime_error("Unsupported storage format: " + std::to_string(format));
+  target_format = format;
+}
+LiveUpdate::storage_format LiveUpdate::get_target_format() noexcept
+{
+  return (storage_format) target_format;
+}
+
 void LiveUpdate::restore_environment()
 {
   // enable interrupts again
@@ -212,7 +505,10 @@ void LiveUpdate::restore_environment()
 }
 size_t LiveUpdate::store(void* location, storage_func func)
 {
-  return update_store_data(location, func, nullptr);
+  const size_t length = update_store_data(location, func, nullptr);
+  if (length == 0)
+      throw std::runtime_error(store_failure);
+  return length;
 }
 
 size_t LiveUpdate::stored_data_length(void* location)
@@ -233,7 +529,8 @@ size_t LiveUpdate::stored_data_length(void* location)
 size_t update_store_data(void* location, LiveUpdate::storage_func func, const buffer_t* blob)
 {
   // create storage header in the fixed location
-  new (location) storage_header();
+  LIVEUPDATE_STORE_GENERATION++;
+  new (location) storage_header(target_format);
   auto* storage = (storage_header*) location;
 
   /// callback for storing stuff, if provided
@@ -241,13 +538,34 @@ size_t update_store_data(void* location, LiveUpdate::storage_func func, const bu
   {
     Storage wrapper {*storage};
     func(wrapper, blob);
+    wrapper.end_section();
+  }
+  /// per-connection blackout records
+  blackout_store(*storage);
+  /// the final cut-over, only when actually updating
+  if (blob != nullptr)
+  {
+#ifdef LIVEUPDATE_DEBUG_ALLOC
+    /// fail before the devices are flushed, when it can still be undone
+    store_failure = critical_allocs();
+    if (store_failure != nullptr) return 0;
+#endif
+    /// 2. flush all devices with flush() interface
+    hw::Devices::flush_all();
+    /// what is left can be reinjected after resume. The packets go last,
+    /// since they are limited by the room that is left
+    inflight_store(*storage);
   }
 
-  /// finalize
-  storage->finalize();
-
-  /// return length (and perform sanity check)
-  return LiveUpdate::stored_data_length(location);
+  /// finalize, then return the length. This runs with interrupts
+  /// disabled during begin(), so failures return zero instead of throwing
+  store_failure = storage->finalize();
+  if (store_failure != nullptr) return 0;
+  if (LIVEUPDATE_PERFORM_SANITY_CHECKS && storage->validate() == false) {
+    store_failure = "Failed sanity check on LiveUpdate storage area";
+    return 0;
+  }
+  return storage->total_bytes();
 }
 
 /// struct Storage
@@ -256,6 +574,23 @@ void Storage::put_marker(uid id)
 {
   hdr.add_marker(id);
 }
+Storage& Storage::section(const std::string& name)
+{
+  hdr.add_section(name);
+  in_section = !name.empty();
+  return *this;
+}
+Storage& Storage::section(const char* name)
+{
+  const size_t len = strlen(name);
+  hdr.add_section(name, len);
+  in_section = len != 0;
+  return *this;
+}
+void Storage::end_section()
+{
+  if (in_section) section("");
+}
 void Storage::add_int(uid id, int value)
 {
   hdr.add_int(id, value);
@@ -264,6 +599,10 @@ void Storage::add_string(uid id, const std::string& str)
 {
   hdr.add_string(id, str);
 }
+void Storage::add_string(uid id, const char* str, size_t len)
+{
+  hdr.add_string(id, str, len);
+}
 void Storage::add_buffer(uid id, const buffer_t& blob)
 {
   hdr.add_buffer(id, blob.data(), blob.size());
@@ -280,13 +619,19 @@ void Storage::add_string_vector(uid id, const std::vector<std::string>& vec)
 {
   hdr.add_string_vector(id, vec);
 }
+void Storage::add_struct(uid id, const char* type, const layout_t& layout,
+                         const void* data, size_t len)
+{
+  hdr.add_layout(id, type, layout, data, len);
+}
 
 #include "serialize_tcp.hpp"
 void Storage::add_connection(uid id, Connection_ptr conn)
 {
-  hdr.add_struct(TYPE_TCP, id,
+  auto& entry = hdr.add_struct(TYPE_TCP, id,
   [&conn] (char* location) -> int {
     // return size of all the serialized data
     return conn->serialize_to(location);
   });
+  blackout_frozen(*conn, entry.len);
 }
@@ -0,0 +1,123 @@
+/**
+ * Master thesis
+ * by Alf-Andre Walla 2016-2017
+ *
+**/
+#include "liveupdate.hpp"
+#include "signature.hpp"
+#include <hw/block_device.hpp>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+//#define LPRINT(x, ...) printf(x, ##__VA_ARGS__);
+#define LPRINT(x, ...) /** x **/
+
+namespace liu
+{
+// read the image in chunks of this size, with a few reads in flight
+static const size_t CHUNK_SIZE = 1024 * 1024;
+static const int    MAX_IN_FLIGHT = 4;
+
+struct image_loader
+{
+  hw::Block_device& dev;
+  uint64_t first;
+  uint64_t blocks;
+  uint64_t next;
+  size_t   chunk_blocks;
+  int      in_flight = 0;
+  bool     failed    = false;
+  buffer_t image;
+  LiveUpdate::image_func on_loaded;
+  LiveUpdate::error_func on_error;
+
+  image_loader(hw::Block_device& d, uint64_t blk,
+               LiveUpdate::image_func ld, LiveUpdate::error_func err)
+    : dev(d), first(blk), on_loaded(ld), on_error(err) {}
+
+  void fail(const char* reason)
+  {
+    if (failed) return;
+    failed = true;
+    on_error(std::runtime_error(reason));
+  }
+};
+typedef std::shared_ptr<image_loader> loader_ptr;
+
+static void read_chunks(loader_ptr loader)
+{
+  while (loader->failed == false
+      && loader->in_flight < MAX_IN_FLIGHT
+      && loader->next < loader->blocks)
+  {
+    const uint64_t blk   = loader->next;
+    const size_t   count = std::min<uint64_t>(loader->chunk_blocks, loader->blocks - blk);
+    loader->next += count;
+    loader->in_flight++;
+
+    loader->dev.read(loader->first + blk, count,
+    [loader, blk, count] (hw::Block_device::buffer_t buffer)
+    {
+      loader->in_flight--;
+      // the image is incomplete, and the error has been reported
+      if (loader->failed) return;
+      if (buffer == nullptr) {
+        loader->fail("Block device read failed during image load");
+        return;
+      }
+      // copy straight into place in the staging buffer
+      const size_t offset = blk * loader->dev.block_size();
+      const size_t len = std::min<size_t>(count * loader->dev.block_size(),
+                                          loader->image.size() - offset);
+      memcpy(&loader->image[offset], buffer.get(), len);
+
+      if (loader->next >= loader->blocks && loader->in_flight == 0) {
+        LPRINT("* Loaded %u byte image from %s\n",
+               (uint32_t) loader->image.size(), loader->dev.device_name().c_str());
+        loader->on_loaded(loader->image);
+      }
+      else read_chunks(loader);
+    });
+  }
+}
+
+void LiveUpdate::load_image(hw::Block_device& dev, uint64_t block,
+                            image_func on_loaded, error_func on_error)
+{
+  // reads complete from the event loop, where nothing can catch a failure
+  if (on_error == nullptr)
+      throw std::runtime_error("LiveUpdate::load_image() needs an error handler");
+  auto loader = std::make_shared<image_loader> (dev, block, on_loaded, on_error);
+  const size_t bsize = dev.block_size();
+  const size_t header_blocks = (IMAGE_HEADER_LEN + bsize - 1) / bsize;
+
+  // read the header to find out how large the image is
+  dev.read(block, header_blocks,
+  [loader, bsize] (hw::Block_device::buffer_t buffer)
+  {
+    if (buffer == nullptr) {
+      loader->fail("Block device read failed during image load");
+      return;
+    }
+    size_t length = LiveUpdate::image_length(buffer.get());
+    if (length == 0) {
+      loader->fail("Could not find any update image on block device");
+      return;
+    }
+    if (LiveUpdate::has_verification_key()) length += TRAILER_LEN;
+
+    loader->blocks = (length + bsize - 1) / bsize;
+    if (loader->first + loader->blocks > loader->dev.size()) {
+      loader->fail("Update image extends past the end of block device");
+      return;
+    }
+    loader->image.resize(length);
+    loader->next = 0;
+    loader->chunk_blocks = std::max<size_t>(1, CHUNK_SIZE / bsize);
+    read_chunks(loader);
+  });
+}
+
+} // liu